@@ -0,0 +1,28 @@
+#!/bin/sh
+# startup_bench.sh [WSH] [RUNS]
+# How long wsh takes to start, run one command found in PATH and exit,
+# with no command cache and then with the one the first run saved.
+
+wsh=${1:-./wsh}
+runs=${2:-500}
+cache=$(mktemp -u /tmp/wsh_bench_cache.XXXXXX)
+export WSH_CMDCACHE="$cache"
+
+# per run, in microseconds
+time_runs() {
+    start=$(date +%s%N)
+    i=0
+    while [ "$i" -lt "$runs" ]; do
+        [ "$1" = cold ] && rm -f "$cache"
+        "$wsh" -c "true" || exit 1
+        i=$((i + 1))
+    done
+    end=$(date +%s%N)
+    echo $(((end - start) / runs / 1000))
+}
+
+echo "$runs runs of $wsh -c true"
+echo "cold cache: $(time_runs cold) us per run"
+"$wsh" -c "true"
+echo "warm cache: $(time_runs warm) us per run"
+rm -f "$cache"
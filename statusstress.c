@@ -0,0 +1,135 @@
+//statusstress.c
+//hammer a set -o status record from one process while another reads it,
+//and count the copies that come out torn
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/* The record and the seqlock, they have to match wsh.c (publish_job(),
+   status_write_begin/end()) and wshstat.c (read_record()).  */
+#define STATUS_COMMAND 96
+
+typedef struct status_record{
+    uint32_t seq;
+    int32_t id;
+    int32_t pgid;
+    int32_t state;
+    int32_t processes;
+    int32_t exit_status;
+    int64_t start_ns;
+    int64_t utime_us;
+    int64_t stime_us;
+    int64_t maxrss_kb;
+    char command[STATUS_COMMAND];
+} status_record;
+
+void status_write_begin(status_record *r){
+    __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void status_write_end(status_record *r){
+    __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELEASE);
+}
+
+void read_record(status_record *r, status_record *out){
+    uint32_t before, after;
+    do{
+        before = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+        if(before & 1)
+            continue;
+        memcpy(out, r, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&r->seq, __ATOMIC_RELAXED);
+    }while((before & 1) || before != after);
+}
+
+//every field of update v says v, so a mix of two updates shows
+void write_update(status_record *r, int32_t v, int locked){
+    if(locked)
+        status_write_begin(r);
+    r->id = v;
+    r->pgid = v;
+    r->state = v;
+    r->processes = v;
+    r->exit_status = v;
+    r->start_ns = v;
+    r->utime_us = v;
+    r->stime_us = v;
+    r->maxrss_kb = v;
+    memset(r->command, 'a' + v % 26, STATUS_COMMAND - 1);
+    r->command[STATUS_COMMAND - 1] = '\0';
+    if(locked)
+        status_write_end(r);
+}
+
+int is_torn(status_record *r){
+    int32_t v = r->id;
+    if(r->pgid != v || r->state != v || r->processes != v || r->exit_status != v
+       || r->start_ns != v || r->utime_us != v || r->stime_us != v || r->maxrss_kb != v)
+        return 1;
+    for(int i = 0; i < STATUS_COMMAND - 1; i++){
+        if(r->command[i] != 'a' + v % 26)
+            return 1;
+    }
+    return 0;
+}
+
+/* statusstress [-u] [SECONDS]: a writer process updates the record as
+   fast as it can while we read it.  -u leaves the seqlock out, to see
+   that the check does catch torn copies.  Exits 1 if any were torn.  */
+int main(int argc, char *argv[]){
+    int locked = 1;
+    double seconds = 2;
+    int i = 1;
+
+    if(i < argc && strcmp(argv[i], "-u") == 0){
+        locked = 0;
+        i++;
+    }
+    if(i < argc)
+        seconds = atof(argv[i]);
+
+    status_record *r = (status_record *)mmap(NULL, sizeof(status_record), PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(r == MAP_FAILED){
+        perror("mmap");
+        return 2;
+    }
+    write_update(r, 0, 1);
+    pid_t writer = fork();
+    if(writer < 0){
+        perror("fork");
+        return 2;
+    }
+    if(writer == 0){
+        for(int32_t v = 1; ; v = v == INT32_MAX ? 1 : v + 1)
+            write_update(r, v, locked);
+    }
+
+    struct timespec start, now;
+    long long reads = 0, torn = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do{
+        for(int k = 0; k < 1000; k++){
+            status_record copy;
+            read_record(r, &copy);
+            torn += is_torn(&copy);
+            reads++;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }while(now.tv_sec - start.tv_sec + (now.tv_nsec - start.tv_nsec) / 1e9 < seconds);
+    kill(writer, SIGKILL);
+    waitpid(writer, NULL, 0);
+
+    printf("%lld reads, %lld torn, last update %d%s\n", reads, torn, r->id,
+           locked ? "" : " (no seqlock)");
+    return torn ? 1 : 0;
+}
@@ -1,5 +1,6 @@
 //wsh.c
 
+#define _GNU_SOURCE     //execveat, O_PATH
 
 #include <stdio.h> 
 #include <stdlib.h>
@@ -9,6 +10,42 @@
 #include <sys/wait.h>
 #include <signal.h>
 #include <termios.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <linux/perf_event.h>
+#include <linux/sched.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+//one redirection of a command, applied in the child before exec
+#define REDIR_IN 0      //fd < path
+#define REDIR_OUT 1     //fd > path
+#define REDIR_APPEND 2  //fd >> path
+#define REDIR_DUP 3     //fd >& src or fd <& src
+#define REDIR_CLOSE 4   //fd >&-
+typedef struct redirect{
+    int fd;
+    int op;
+    int src;            //for REDIR_DUP
+    char *path;         //for the file ops
+} redirect;
 
 //process struct
 typedef struct process{
@@ -18,8 +55,35 @@ typedef struct process{
     char completed;             //keep track of process completion
     char stopped;               //true when stopped
     int status;
+    char **assigns;             //VAR=x overrides for this command only
+    int exec_dirfd;             //PATH dir handle the command was found in
+    char *exec_name;            //name to exec relative to exec_dirfd, NULL to search PATH
+    char exec_cached;           //true when exec_name came from the lookup cache
+    char *exec_path;            //dir/name for a #! script, its interpreter can't use the handle
+    int pidfd;                  //opened by wait while it polls the process, else -1
+    struct rusage usage;        //filled in when the process is reaped
+    redirect *redirs;           //in the order they were written
+    int nredirs;
+    const struct stage_builtin *stage_builtin;   //run in the child instead of an exec
+    struct function *function;  //a shell function, run by the shell or a subshell
+    struct function *group;     //body of a ( ... ) group
+    int perf_fd[4];             //set -o perf counters, see perf_events
+    unsigned char perf_open;    //bit i set while perf_fd[i] is open
+    unsigned char perf_read;    //bit i set once perf_count[i] holds its total
+    unsigned long long perf_count[4];
+    long long started_ns;       //when its exec took, 0 if it never did
+    char torn_down;             //the shell sent it SIGTERM, see teardown_job
 } process;
 
+//bounded buffer keeping the newest output of a captured job
+typedef struct ring{
+    char *data;
+    size_t cap;         //bytes allocated
+    size_t head;        //where the next byte goes
+    size_t len;         //bytes held, at most cap
+    size_t dropped;     //older bytes overwritten
+} ring;
+
 //pipeline of processes
 typedef struct job{
     struct job *next;   //pointer to next active job
@@ -29,8 +93,30 @@ typedef struct job{
     int id;         //what its id is (will loop this to find next id)
     int curr_bg;    //represents if procces is in the background
     char notified;
+    char waited;        //wait has already returned its status
     struct termios tmodes;      //saved terminal modes might not use
     int stdin, stdout, stderr; //not sure if i need stderr
+    int capture_fd;     //read end of the captured stdout/stderr pipe, -1 if none
+    ring *output;       //tail of the captured output
+    char output_shown;  //true once the user looked at the output
+    int launch_status;  //126/127 when a stage failed to start, else 0
+    char *coproc_name;  //set for a coprocess started with coproc NAME
+    int coproc_in;      //shell's end of the coprocess stdin, -1 once closed
+    int coproc_out;     //shell's end of the coprocess stdout
+    char owned;         //a builtin started it and reaps it itself, no notices
+    long long launched_ns;  //when launch_job() got it, on the monotonic clock
+    int status_slot;    //record in the status page, -1 if none
+    long long completed_ns; //when its last process was reaped
+    unsigned int journal_id;    //numbers its records in the journal, 0 if none
+    long long timeout_ns;       //timeout DURATION or WSH_TIMEOUT, 0 for none
+    long long grace_ns;         //SIGTERM to SIGKILL
+    int timeout_signal;
+    int timer_fd;               //timerfd watched by the event loop, -1 if none
+    char timed_out;             //the deadline passed, the job's status is 124
+    struct job_limit *limits;   //from ulimit ... cmd, applied in each child
+    int nlimits;
+    int cgroup_fd;              //the job's own cgroup, -1 if it has none
+    int cgroup_serial;          //its name under the shell's
 }job;
 
 job *first_job = NULL;
@@ -40,6 +126,192 @@ int next_job_id = 1;
 char *buffer;
 char *path = "/bin";
 size_t bufsize = 256;
+#define MAX_ARGS 4096   //words on one command line once globs are expanded
+
+//shell variables, hashed by name
+#define VAR_BUCKETS 128
+typedef struct var{
+    struct var *next;   //next var in the same bucket
+    char *name;
+    char *value;
+    char exported;      //true when passed to children
+} var;
+
+var *var_table[VAR_BUCKETS];
+
+//envp snapshot handed to execve, rebuilt only when an exported var changes
+#define ENV_SPARE 32    //free slots left at the end for VAR=x cmd overrides
+char **env_snapshot = NULL;
+int env_count = 0;
+int env_dirty = 1;
+
+//PATH directories, opened once as O_PATH handles
+typedef struct path_dir{
+    int fd;             //AT_FDCWD for empty or relative entries
+    char *name;
+    struct stat st;     //taken when opened, validates the on-disk cache
+} path_dir;
+
+path_dir *path_dirs = NULL;
+int path_dir_count = 0;
+int path_dirty = 1;     //set when PATH changes
+
+//commands already found on PATH, cached as dirfd + name
+#define CMD_BUCKETS 256
+typedef struct cmd_entry{
+    struct cmd_entry *next;
+    char *name;
+    int dirfd;
+    int dir;            //index into path_dirs
+    char *path;         //dir/name if it's a #! script, else NULL
+} cmd_entry;
+
+cmd_entry *cmd_table[CMD_BUCKETS];
+cmd_entry *stale_cmds = NULL;   //found gone this session, the disk cache is wrong about them
+int cmd_cache_dirty = 0;    //found something the disk cache doesn't have
+
+/* The command cache is saved to a small file and mapped read-only by the
+   next shell, so a cold start resolves commands without probing.  It is
+   only trusted while PATH is the same string and every PATH dir still
+   has the mtime it had when the file was written.
+   Layout: header, dirs[ndirs], slots[nslots], then the names.  */
+#define DISK_CACHE_MAGIC 0x43485357     //"WSHC"
+typedef struct disk_cache_header{
+    unsigned int magic;
+    unsigned int path_hash;     //name_hash of PATH
+    unsigned int ndirs;
+    unsigned int nslots;        //power of two, open addressing
+} disk_cache_header;
+
+typedef struct disk_cache_dir{
+    long long mtime_sec;
+    long long mtime_nsec;
+    unsigned long long dev;
+    unsigned long long ino;
+} disk_cache_dir;
+
+typedef struct disk_cache_slot{
+    unsigned int name_off;      //0 marks an empty slot
+    int dir;
+} disk_cache_slot;
+
+char *disk_cache = NULL;        //the mapped file, NULL if missing or stale
+size_t disk_cache_len = 0;
+
+//what a child reports over its CLOEXEC pipe when an exec attempt fails
+typedef struct exec_report{
+    int dir;    //PATH dir index that failed, -1 once the child gives up
+    int err;    //errno from execveat
+} exec_report;
+
+//extra fds the main loop polls along with the input
+typedef struct watch{
+    int fd;
+    void (*handler)(int fd, void *data);
+    void *data;
+} watch;
+
+watch *watches = NULL;
+int watch_count = 0;
+int watch_cap = 0;
+
+//SIGCHLD writes a byte here so the loop knows to reap
+int sigchld_pipe[2] = {-1, -1};
+
+//input is read through our own buffer so poll knows when a line is waiting
+typedef struct line_reader{
+    int fd;
+    char *data;
+    size_t cap;
+    size_t start;       //first unread byte
+    size_t len;         //bytes in data
+    int eof;
+} line_reader;
+
+//set -o options
+#define CAPTURE_SIZE 65536      //default bytes kept per captured job
+int capture_bg = 0;             //capture output of background jobs
+int pipefail = 0;               //a pipeline fails if any stage fails
+int pipe_teardown = 0;          //signal upstream stages once a later one exits
+int status_on = 0;              //publish the job table in /dev/shm, or WSH_STATUS set
+int perf_on = 0;                //count cycles, instructions... for each process
+int cgroup_on = 0;              //a cgroup for every job, or WSH_CGROUP set
+
+int last_status = 0;            //$?
+
+//fds new jobs start with; the daemon points them at a client's fds
+int job_stdin = STDIN_FILENO;
+int job_stdout = STDOUT_FILENO;
+int job_stderr = STDERR_FILENO;
+int run_in_background = 0;      //launch every job as if it ended in &
+int spawn_own_group = 0;        //put the job being spawned in its own group anyway
+int helper_threads = 0;         //running beside the main one, the journal writer
+long long next_timeout_ns = 0;  //set by the timeout builtin for its one job
+long long next_grace_ns = -1;
+int next_timeout_signal = SIGTERM;
+struct job_limit *next_limits = NULL;   //set by ulimit ... cmd for its one job
+int next_nlimits = 0;
+struct job_limit *spawn_limits = NULL;  //the limits of the job being spawned
+int spawn_nlimits = 0;
+int next_cgroup = 0;            //set by the cgroup builtin for its one job
+char next_cpu_max[32] = "";     //cpu.max and memory.max for it, "" leaves them be
+char next_memory_max[32] = "";
+int want_terminal = 1;          //0 keeps init_shell away from the tty
+
+//shell functions, kept as the raw words of each body line so a call
+//only has to expand them
+#define FUNC_BUCKETS 64
+#define FUNC_DEPTH_MAX 200
+typedef struct function{
+    struct function *next;      //next function in the same bucket
+    char *name;
+    char ***lines;              //NULL terminated words of each body line
+    int nlines;
+    char forks;                 //a ( ) group that has to run in a subshell
+} function;
+
+function *func_table[FUNC_BUCKETS];
+int func_depth = 0;             //calls running right now
+int func_returning = 0;         //return was run, stop the current body
+
+//set while running the last line of a script or -c, nothing runs after it
+int last_line = 0;
+int exec_in_place = 0;          //the job being launched may replace the shell
+
+//$0, $1, ... of the running function, NULL at the top level
+char **positional = NULL;
+int positional_count = 0;
+
+//a command line submitted to the daemon and the job running it
+typedef struct client{
+    struct client *next;
+    int fd;             //connection the reply goes back on, -1 once it hung up
+    int fds[3];         //stdin, stdout, stderr passed with SCM_RIGHTS, -1 if not sent
+    job *job;
+} client;
+
+client *first_client = NULL;
+
+//what the daemon sends back once a submitted command finishes
+typedef struct daemon_reply{
+    int status;
+    struct rusage usage;    //children's usage summed over the job
+} daemon_reply;
+
+typedef struct shell_option{
+    const char *name;
+    int *flag;
+} shell_option;
+
+shell_option shell_options[] = {
+    {"capture", &capture_bg},
+    {"pipefail", &pipefail},
+    {"teardown", &pipe_teardown},
+    {"status", &status_on},
+    {"perf", &perf_on},
+    {"cgroup", &cgroup_on},
+    {NULL, NULL}
+};
 
 //global variables for the shell init
 pid_t shell_pgid;
@@ -47,262 +319,3731 @@ struct termios shell_tmodes;
 int shell_terminal;
 int shell_is_interactive;
 
-//utility functions for operating job objects
+extern char **environ;
 
-//find active job
-job *
-find_job (pid_t pgid){
-    job *j;
-    for (j = first_job; j; j=j->next){
-        if(j->pgid == pgid)
-            return j;
+//utility functions for shell variables
+
+//FNV-1a hash of a name, callers reduce it to their table size
+unsigned int
+name_hash (const char *name, size_t len){
+    unsigned int h = 2166136261u;
+    for(size_t i = 0; i < len; i++){
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
     }
-    return NULL;
+    return h;
 }
 
-//return true if all process in job is stooped or completed
-int
-job_is_stopped (job *j){
-    process *p;
-    for(p= j->first_process; p; p=p->next){
-        if(!p->completed && !p->stopped)
-            return 0;
-    }
-    return 1;
+unsigned int
+var_hash (const char *name, size_t len){
+    return name_hash(name, len) % VAR_BUCKETS;
 }
 
-//return true if all processes in job have completed
-int
-job_is_completed(job *j){
-    process *p;
-    for(p = j->first_process; p; p = p->next){
-        if(!p->completed)
-            return 0;
+//find a variable by the first len chars of name
+var *
+find_var (const char *name, size_t len){
+    var *v;
+    for(v = var_table[var_hash(name, len)]; v; v = v->next){
+        if(strncmp(v->name, name, len) == 0 && v->name[len] == '\0')
+            return v;
     }
-    return 1;
+    return NULL;
 }
 
-/* Store the status of the process pid that was returned by waitpid.
-   Return 0 if all went well, nonzero otherwise.  */
+//return the value of a variable or NULL when unset
+char *
+get_var (const char *name){
+    var *v = find_var(name, strlen(name));
+    return v ? v->value : NULL;
+}
 
-int
-mark_process_status (pid_t pid, int status)
-{
-  job *j;
-  process *p;
+/* Set a variable, creating it if needed.  export is 1 to export it,
+   0 to leave the export flag as it was.  */
+void
+set_var (const char *name, const char *value, int export){
+    size_t len = strlen(name);
+    var *v = find_var(name, len);
 
-  if (pid > 0)
-    {
-      /* Update the record for the process.  */
-      for (j = first_job; j; j = j->next)
-        for (p = j->first_process; p; p = p->next)
-          if (p->pid == pid)
-            {
-              p->status = status;
-              if (WIFSTOPPED (status))
-                p->stopped = 1;
-              else
-                {
-                  p->completed = 1;
-                  if (WIFSIGNALED (status))
-                    fprintf (stderr, "%d: Terminated by signal %d.\n",
-                             (int) pid, WTERMSIG (p->status));
-                }
-              return 0;
-             }
-      fprintf (stderr, "No child process %d.\n", pid);
-      return -1;
+    if(v == NULL){
+        unsigned int h = var_hash(name, len);
+        v = (var *)malloc(sizeof(var));
+        if(v == NULL){
+            perror("Unable to allocate variable");
+            exit(1);
+        }
+        v->name = strdup(name);
+        v->value = NULL;
+        v->exported = 0;
+        v->next = var_table[h];
+        var_table[h] = v;
     }
-  else if (pid == 0) //|| errno == ECHILD took out
-    /* No processes ready to report.  */
-    return -1;
-  else {
-    /* Other weird errors.  */
-    perror ("waitpid");
-    return -1;
-  }
+    if(value != NULL){
+        free(v->value);
+        v->value = strdup(value);
+    }
+    else if(v->value == NULL){
+        v->value = strdup("");
+    }
+    if(export)
+        v->exported = 1;
+    if(strcmp(name, "PATH") == 0)
+        path_dirty = 1;
+    //only exported vars end up in the exec environment
+    if(v->exported)
+        env_dirty = 1;
 }
 
-/* Check for processes that have status information available,
-   without blocking.  */
-
 void
-update_status (void)
-{
-  int status;
-  pid_t pid;
+unset_var (const char *name){
+    size_t len = strlen(name);
+    var **link = &var_table[var_hash(name, len)];
+    var *v;
 
-  do
-    pid = waitpid (WAIT_ANY, &status, WUNTRACED|WNOHANG);
-  while (!mark_process_status (pid, status));
+    for(v = *link; v; link = &v->next, v = v->next){
+        if(strcmp(v->name, name) == 0){
+            *link = v->next;
+            if(v->exported)
+                env_dirty = 1;
+            if(strcmp(name, "PATH") == 0)
+                path_dirty = 1;
+            free(v->name);
+            free(v->value);
+            free(v);
+            return;
+        }
+    }
 }
 
-/* Check for processes that have status information available,
-   blocking until all processes in the given job have reported.  */
-
+//load the environment we were started with as exported vars
 void
-wait_for_job (job *j)
-{
-  int status;
-  pid_t pid;
-
-  do
-    pid = waitpid (WAIT_ANY, &status, WUNTRACED);
-  while (!mark_process_status (pid, status)
-         && !job_is_stopped (j)
-         && !job_is_completed (j));
+import_environ (void){
+    char **e;
+    for(e = environ; *e; e++){
+        char *eq = strchr(*e, '=');
+        if(eq == NULL)
+            continue;
+        char *name = strndup(*e, eq - *e);
+        set_var(name, eq + 1, 1);
+        free(name);
+    }
 }
 
-/* Format information about job status for the user to look at.  */
+/* Return the envp snapshot for execve.  It is only rebuilt after an
+   exported variable changed; children layer their VAR=x overrides on
+   top of it in the spare slots after fork, so the parent copy is
+   never touched.  */
+char **
+get_envp (void){
+    var *v;
+    int n = 0;
 
-void
-format_job_info (job *j, const char *status)
-{
-  fprintf (stderr, "%ld (%s): %s\n", (long)j->pgid, status, j->command);
-}
+    if(!env_dirty)
+        return env_snapshot;
 
-/* Notify the user about stopped or terminated jobs.
-   Delete terminated jobs from the active job list.  */
+    if(env_snapshot){
+        for(int i = 0; i < env_count; i++)
+            free(env_snapshot[i]);
+        free(env_snapshot);
+    }
+    for(int b = 0; b < VAR_BUCKETS; b++)
+        for(v = var_table[b]; v; v = v->next)
+            if(v->exported)
+                n++;
 
-void
-do_job_notification (void)
-{
-  job *j, *jlast, *jnext;
+    env_snapshot = (char **)calloc(n + ENV_SPARE + 1, sizeof(char *));
+    if(env_snapshot == NULL){
+        perror("Unable to allocate environment");
+        exit(1);
+    }
+    env_count = 0;
+    for(int b = 0; b < VAR_BUCKETS; b++)
+        for(v = var_table[b]; v; v = v->next)
+            if(v->exported){
+                size_t len = strlen(v->name) + strlen(v->value) + 2;
+                char *entry = (char *)malloc(len);
+                snprintf(entry, len, "%s=%s", v->name, v->value);
+                env_snapshot[env_count++] = entry;
+            }
+    env_dirty = 0;
+    return env_snapshot;
+}
 
-  /* Update status information for child processes.  */
-  update_status ();
+//true if word looks like NAME=value
+int
+is_assignment (const char *word){
+    const char *c = word;
+    if(!(*c == '_' || (*c >= 'A' && *c <= 'Z') || (*c >= 'a' && *c <= 'z')))
+        return 0;
+    while(*c == '_' || (*c >= 'A' && *c <= 'Z') || (*c >= 'a' && *c <= 'z')
+          || (*c >= '0' && *c <= '9'))
+        c++;
+    return *c == '=';
+}
 
-  jlast = NULL;
-  for (j = first_job; j; j = jnext)
-    {
-      jnext = j->next;
+/* Replace $VAR and ${VAR} in word with their values.
+   Returns a newly allocated string.  */
+char *
+expand_word (const char *word){
+    size_t cap = strlen(word) + 1, len = 0;
+    char *out = (char *)malloc(cap);
+    const char *c = word;
 
-      /* If all processes have completed, tell the user the job has
-         completed and delete it from the list of active jobs.  */
-      if (job_is_completed (j)) {
-        format_job_info (j, "completed");
-        if (jlast)
-          jlast->next = jnext;
-        else
-          first_job = jnext;
-        //free_job (j);
-      }
+    while(*c){
+        const char *value = NULL;
+        const char *name = NULL;
+        size_t name_len = 0;
 
-      /* Notify the user about stopped jobs,
-         marking them so that we won’t do this more than once.  */
-      else if (job_is_stopped (j) && !j->notified) {
-        format_job_info (j, "stopped");
-        j->notified = 1;
-        jlast = j;
-      }
+        char status_buf[16];
+        char *joined = NULL;
+        if(c[0] == '$' && c[1] == '?'){
+            snprintf(status_buf, sizeof(status_buf), "%d", last_status);
+            value = status_buf;
+            c += 2;
+        }
+        else if(c[0] == '$' && c[1] >= '0' && c[1] <= '9'){
+            int n = c[1] - '0';
+            if(n == 0)
+                value = positional ? positional[0] : "wsh";
+            else
+                value = n < positional_count ? positional[n] : "";
+            c += 2;
+        }
+        else if(c[0] == '$' && c[1] == '#'){
+            snprintf(status_buf, sizeof(status_buf), "%d", positional_count > 0 ? positional_count - 1 : 0);
+            value = status_buf;
+            c += 2;
+        }
+        else if(c[0] == '$' && (c[1] == '@' || c[1] == '*')){
+            //inside a word they join with spaces, a lone $@ is split by expand_tokens
+            size_t total = 1;
+            for(int k = 1; k < positional_count; k++)
+                total += strlen(positional[k]) + 1;
+            joined = (char *)calloc(total, 1);
+            for(int k = 1; k < positional_count; k++){
+                if(k > 1)
+                    strcat(joined, " ");
+                strcat(joined, positional[k]);
+            }
+            value = joined;
+            c += 2;
+        }
+        else if(c[0] == '$' && c[1] == '{'){
+            const char *end = strchr(c + 2, '}');
+            if(end){
+                name = c + 2;
+                name_len = end - name;
+                c = end + 1;
+            }
+        }
+        else if(c[0] == '$' && (c[1] == '_' || (c[1] >= 'A' && c[1] <= 'Z')
+                                || (c[1] >= 'a' && c[1] <= 'z'))){
+            name = c + 1;
+            while(name[name_len] == '_' || (name[name_len] >= 'A' && name[name_len] <= 'Z')
+                  || (name[name_len] >= 'a' && name[name_len] <= 'z')
+                  || (name[name_len] >= '0' && name[name_len] <= '9'))
+                name_len++;
+            c = name + name_len;
+        }
 
-      /* Don’t say anything about jobs that are still running.  */
-      else
-        jlast = j;
+        if(name){
+            var *v = find_var(name, name_len);
+            value = (v && v->value) ? v->value : "";
+        }
+
+        //value is NULL for a plain character, copy it through
+        size_t add = value ? strlen(value) : 1;
+        if(len + add + 1 > cap){
+            cap = (len + add + 1) * 2;
+            out = (char *)realloc(out, cap);
+        }
+        if(value){
+            memcpy(out + len, value, add);
+        }
+        else{
+            out[len] = *c++;
+        }
+        len += add;
+        free(joined);
     }
+    out[len] = '\0';
+    return out;
 }
 
+/* Big long-lived buffers, captured output and glob listings, get
+   mappings of their own marked MADV_DONTFORK.  fork() then copies no
+   page tables for them however much the shell has cached, and a child
+   that doesn't exec has to forget every pointer into them, see
+   become_subshell().  Small ones stay on the heap.  */
+#define SHELL_MAP_MIN 16384
+#define SHELL_MAP_HEADER 16     //keeps the bytes handed out aligned
+size_t shell_mapped = 0;        //bytes in DONTFORK mappings right now
 
-/* Put a job in the background.  If the cont argument is true, send
-   the process group a SIGCONT signal to wake it up.  */
+//what fork() costs the shell, as seen by the parent in spawn_process()
+long long fork_count = 0;
+long long fork_ns_total = 0;
+long long fork_ns_last = 0;
+long long fork_ns_max = 0;
 
-void
-put_job_in_background (job *j, int cont)
-{
-  /* Send the job a continue signal, if necessary.  */
-  if (cont)
-    if (kill (-j->pgid, SIGCONT) < 0)
-      perror ("kill (SIGCONT)");
+//nanoseconds on the monotonic clock
+long long now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-void
-put_job_in_foreground (job *j, int cont)
-{
-  /* Put the job into the foreground.  */
-  tcsetpgrp (shell_terminal, j->pgid);
-
-  /* Send the job a continue signal, if necessary.  */
-  if (cont)
-    {
-      tcsetattr (shell_terminal, TCSADRAIN, &j->tmodes);
-      if (kill (- j->pgid, SIGCONT) < 0)
-        perror ("kill (SIGCONT)");
-    }
+//how long pipelines take to get going, see launch_job()
+long long vfork_count = 0;          //stages started by spawn_stage() instead
+long long pipeline_ns_last = 0;     //launch_job() start to the last stage running
+int pipeline_stages_last = 0;
+char pipeline_concurrent_last = 0;
+long long first_byte_ns_last = -1;  //launch to a captured job's first output
 
-  /* Wait for it to report.  */
-  wait_for_job (j);
+void *shell_map(size_t len){
+    size_t total = len + SHELL_MAP_HEADER;
+    char *block = MAP_FAILED;
 
-  /* Put the shell back in the foreground.  */
-  tcsetpgrp (shell_terminal, shell_pgid);
+    if(total >= SHELL_MAP_MIN){
+        block = (char *)mmap(NULL, total, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(block != MAP_FAILED && madvise(block, total, MADV_DONTFORK) < 0){
+            munmap(block, total);
+            block = MAP_FAILED;
+        }
+    }
+    if(block == MAP_FAILED){
+        block = (char *)malloc(total);
+        if(block == NULL)
+            return NULL;
+        total = 0;      //marks a heap block
+    }
+    *(size_t *)block = total;
+    shell_mapped += total;
+    return block + SHELL_MAP_HEADER;
+}
 
-  /* Restore the shell’s terminal modes.  */
-  tcgetattr (shell_terminal, &j->tmodes);
-  tcsetattr (shell_terminal, TCSADRAIN, &shell_tmodes);
+void shell_unmap(void *data){
+    if(data == NULL)
+        return;
+    char *block = (char *)data - SHELL_MAP_HEADER;
+    size_t total = *(size_t *)block;
+    if(total == 0){
+        free(block);
+        return;
+    }
+    shell_mapped -= total;
+    munmap(block, total);
 }
 
+/* Always-on counters for the stats builtin.  The shell is single
+   threaded where these are bumped, so a plain increment is all they
+   cost.  Latencies go into log-linear histograms in the manner of HDR
+   histograms: a bucket per 1/8 of each power of two of nanoseconds,
+   fine enough for percentiles within about 12%.  */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
 
+typedef struct histogram{
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned long long buckets[HIST_BUCKETS];
+} histogram;
 
-void setup(){
+typedef struct shell_stats{
+    unsigned long long execs;           //processes that exec'd a command
+    unsigned long long exec_failures;
+    unsigned long long path_hits;       //get_path() found it cached
+    unsigned long long path_misses;
+    unsigned long long jobs_launched;
+    unsigned long long jobs_reaped;
+    histogram spawn;        //start of a fork until the exec took
+    histogram exec_reap;    //exec until the process was reaped
+    histogram notify;       //a job finishing until the user heard of it
+} shell_stats;
 
-    //give space for the buffer
-    buffer = (char *)malloc(bufsize * sizeof(char));
-    if( buffer == NULL)
-    {
-        perror("Unable to allocate buffer");
-        exit(1);
-    }
-    // // Initialize jobs array
-    // for (int i = 0; i < 256; i++) {
-    //     job[i].id = -1;
-    // }
+shell_stats stats;
 
-    //ADD CODE do i need to handle end of file for both modes 
+int hist_index(unsigned long long v){
+    if(v < HIST_SUB)
+        return (int)v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((v >> shift) & (HIST_SUB - 1));
 }
 
-/* will set some global vars and make sure forks will go offf our 
-*  current shell and not make its own one
-*/
-void init_shell(){
-    //make sure we are running interactively
-    shell_terminal = STDIN_FILENO;
-    shell_is_interactive = isatty(shell_terminal);
+//the smallest value that lands in bucket i
+unsigned long long hist_lower(int i){
+    if(i < HIST_SUB)
+        return i;
+    return (unsigned long long)(HIST_SUB + i % HIST_SUB) << (i / HIST_SUB - 1);
+}
 
-    if(shell_is_interactive){
-        //loop until we are in the fg
-        while(tcgetpgrp(shell_terminal) != (shell_pgid = getpgrp())){
-            kill(-shell_pgid, SIGTTIN); //kills all processes with pid if pid negative
+void hist_record(histogram *h, long long ns){
+    if(ns < 0)
+        ns = 0;
+    h->buckets[hist_index(ns)]++;
+    h->count++;
+    h->sum += ns;
+    if((unsigned long long)ns > h->max)
+        h->max = ns;
+}
+
+//the value at or below which a fraction q of the samples fall
+unsigned long long hist_percentile(histogram *h, double q){
+    unsigned long long want = (unsigned long long)(q * h->count + 0.5), seen = 0;
+    if(want == 0)
+        want = 1;
+    for(int i = 0; i < HIST_BUCKETS; i++){
+        seen += h->buckets[i];
+        if(seen >= want){
+            unsigned long long top = i + 1 < HIST_BUCKETS ? hist_lower(i + 1) - 1 : h->max;
+            return top < h->max ? top : h->max;
         }
+    }
+    return h->max;
+}
 
-        /* Ignore interactive and job-control signals.  */
-        signal (SIGINT, SIG_IGN); //will need to set all these back to defualt for forks
-        signal (SIGQUIT, SIG_IGN);
-        signal (SIGTSTP, SIG_IGN);
-        signal (SIGTTIN, SIG_IGN);
-        signal (SIGTTOU, SIG_IGN);
-        signal (SIGCHLD, SIG_IGN);
+/* Pathname expansion for *, ?, [...] and **.  Directories are read
+   with getdents64 straight into a listing that stays cached, keyed by
+   the directory's dev/ino and checked against its mtime, so a script
+   globbing the same big directory over and over scans it once.  A
+   listing taken within two seconds of the directory's last change isn't
+   kept, the mtime might not move for a change in the same tick.  ** is
+   expanded by walking the tree, with threads once it turns out big.  */
+#define GLOB_CACHE_BUCKETS 64
+#define GLOB_CACHE_MAX 256          //listings kept, least recently used go first
+#define GLOB_PARALLEL_AT 256        //dirs found before ** starts threads
+#define GLOB_THREADS 8
 
-        //put the shell in its own process group 
-        shell_pgid = getpid();
-        if(setpgid(shell_pgid, shell_pgid) < 0) //returns -1 error
-        {
-          perror ("Couldn't put the shell in its own process group");
-          exit (1);
-        }
-        // Grab control of the terminal.  set to foreground
-        tcsetpgrp (shell_terminal, shell_pgid);
+typedef struct dir_listing{
+    struct dir_listing *next;   //next in the same bucket
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    char **names;               //one shell_map() block, types and the names follow
+    unsigned char *types;       //d_type of each name
+    int count;
+    long long used;             //glob_clock when last handed out
+    char cached;                //0 for a racy listing the caller frees
+} dir_listing;
 
-        /* Save default terminal attributes for shell.  */
-        tcgetattr (shell_terminal, &shell_tmodes);
+dir_listing *glob_cache[GLOB_CACHE_BUCKETS];
+dir_listing *glob_retired = NULL;   //replaced while a glob may still use them
+int glob_cache_count = 0;
+long long glob_clock = 0;
+pthread_mutex_t glob_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct glob_list{
+    char **paths;
+    int count;
+    int cap;
+} glob_list;
+
+//what getdents64 fills the buffer with
+struct linux_dirent64{
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+void glob_add(glob_list *l, char *path){
+    if(l->count == l->cap){
+        l->cap = l->cap ? l->cap * 2 : 64;
+        l->paths = (char **)realloc(l->paths, l->cap * sizeof(char *));
     }
+    l->paths[l->count++] = path;
 }
 
-void launch_process (process *p, pid_t pgid,
-                int infile, int outfile, int errfile,
-                int curr_bg, char *curr_path)
-{
-  pid_t pid;
+char *glob_join(const char *base, const char *name){
+    size_t blen = strlen(base);
+    char *out = (char *)malloc(blen + strlen(name) + 2);
+    if(blen == 0)
+        strcpy(out, name);
+    else if(base[blen-1] == '/')
+        sprintf(out, "%s%s", base, name);
+    else
+        sprintf(out, "%s/%s", base, name);
+    return out;
+}
 
-  if (shell_is_interactive)
+void free_listing(dir_listing *d){
+    shell_unmap(d->names);
+    free(d);
+}
+
+/* Read every entry of the open directory fd.  The names gather in a
+   scratch buffer and are packed into one block once the count is known,
+   so a cached listing is a single allocation.  */
+dir_listing *scan_dir(int fd){
+    char buf[32768];
+    long n;
+    size_t used = 0, cap = 4096;
+    char *scratch = (char *)malloc(cap);    //d_type then the name, for each entry
+    dir_listing *d = (dir_listing *)calloc(1, sizeof(dir_listing));
+
+    while((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0){
+        for(long off = 0; off < n;){
+            struct linux_dirent64 *e = (struct linux_dirent64 *)(buf + off);
+            off += e->d_reclen;
+            if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+                continue;
+            size_t len = strlen(e->d_name) + 1;
+            if(used + len + 1 > cap){
+                cap = (used + len + 1) * 2;
+                scratch = (char *)realloc(scratch, cap);
+            }
+            scratch[used] = e->d_type;
+            memcpy(scratch + used + 1, e->d_name, len);
+            used += len + 1;
+            d->count++;
+        }
+    }
+
+    //names array, then types, then the strings
+    size_t strings = d->count * sizeof(char *) + d->count;
+    d->names = (char **)shell_map(strings + used - d->count);
+    d->types = (unsigned char *)(d->names + d->count);
+    char *out = (char *)d->names + strings;
+    for(size_t at = 0, i = 0; at < used; i++){
+        size_t len = strlen(scratch + at + 1) + 1;
+        d->types[i] = scratch[at];
+        d->names[i] = out;
+        memcpy(out, scratch + at + 1, len);
+        out += len;
+        at += len + 1;
+    }
+    free(scratch);
+    return d;
+}
+
+int listing_cmp_used(const void *a, const void *b){
+    long long x = (*(dir_listing **)a)->used, y = (*(dir_listing **)b)->used;
+    return x < y ? -1 : x > y;
+}
+
+/* Drop least recently used listings down to the limit.  Only done
+   between globs, so nothing handed out is ever freed from under it.
+   A ** walk can leave thousands, so they're sorted once by age rather
+   than searched for the oldest one at a time.  */
+void trim_glob_cache(void){
+    while(glob_retired){
+        dir_listing *next = glob_retired->next;
+        free_listing(glob_retired);
+        glob_retired = next;
+    }
+    if(glob_cache_count <= GLOB_CACHE_MAX)
+        return;
+    dir_listing **all = (dir_listing **)malloc(glob_cache_count * sizeof(dir_listing *));
+    int n = 0;
+    for(int b = 0; b < GLOB_CACHE_BUCKETS; b++){
+        for(dir_listing *d = glob_cache[b]; d; d = d->next)
+            all[n++] = d;
+        glob_cache[b] = NULL;
+    }
+    qsort(all, n, sizeof(dir_listing *), listing_cmp_used);
+    //free the oldest, put the rest back in their buckets
+    for(int i = 0; i < n; i++){
+        if(i < n - GLOB_CACHE_MAX){
+            free_listing(all[i]);
+            continue;
+        }
+        unsigned int h = (unsigned int)(all[i]->ino ^ all[i]->dev) % GLOB_CACHE_BUCKETS;
+        all[i]->next = glob_cache[h];
+        glob_cache[h] = all[i];
+    }
+    glob_cache_count = GLOB_CACHE_MAX;
+    free(all);
+}
+
+/* The listing of dir, from the cache when the directory hasn't changed.
+   NULL if it can't be read.  Safe to call from the ** walkers.  */
+dir_listing *get_listing(const char *dir){
+    struct stat st;
+    const char *path = dir[0] ? dir : ".";
+
+    if(stat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+        return NULL;
+    unsigned int h = (unsigned int)(st.st_ino ^ st.st_dev) % GLOB_CACHE_BUCKETS;
+
+    pthread_mutex_lock(&glob_lock);
+    for(dir_listing *d = glob_cache[h]; d; d = d->next){
+        if(d->ino == st.st_ino && d->dev == st.st_dev){
+            if(d->mtime.tv_sec == st.st_mtim.tv_sec && d->mtime.tv_nsec == st.st_mtim.tv_nsec){
+                d->used = ++glob_clock;
+                pthread_mutex_unlock(&glob_lock);
+                return d;
+            }
+            break;      //stale, replaced below
+        }
+    }
+    pthread_mutex_unlock(&glob_lock);
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0)
+        return NULL;
+    dir_listing *d = scan_dir(fd);
+    close(fd);
+    d->dev = st.st_dev;
+    d->ino = st.st_ino;
+    d->mtime = st.st_mtim;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if(now.tv_sec - st.st_mtim.tv_sec < 2)
+        return d;   //racy, d->cached stays 0
+
+    pthread_mutex_lock(&glob_lock);
+    //drop the stale one, or a copy another walker just added
+    for(dir_listing **old = &glob_cache[h]; *old; old = &(*old)->next){
+        if((*old)->ino == d->ino && (*old)->dev == d->dev){
+            dir_listing *gone = *old;
+            *old = gone->next;
+            glob_cache_count--;
+            //someone may still be reading it, keep it until the next glob
+            gone->next = glob_retired;
+            glob_retired = gone;
+            break;
+        }
+    }
+    d->cached = 1;
+    d->used = ++glob_clock;
+    d->next = glob_cache[h];
+    glob_cache[h] = d;
+    glob_cache_count++;
+    pthread_mutex_unlock(&glob_lock);
+    return d;
+}
+
+void put_listing(dir_listing *d){
+    if(d && !d->cached)
+        free_listing(d);
+}
+
+//does s contain an unescaped *, ? or [
+int has_glob_chars(const char *s){
+    for(; *s; s++){
+        if(*s == '\\' && s[1])
+            s++;
+        else if(*s == '*' || *s == '?' || *s == '[')
+            return 1;
+    }
+    return 0;
+}
+
+//match one path component, a leading dot has to be matched explicitly
+int glob_match(const char *pat, const char *name){
+    if(name[0] == '.' && pat[0] != '.')
+        return 0;
+    const char *star_pat = NULL, *star_name = NULL;
+    while(*name){
+        if(*pat == '*'){
+            star_pat = ++pat;
+            star_name = name;
+            continue;
+        }
+        if(*pat == '[' && strchr(pat + 1, ']')){
+            const char *c = pat + 1;
+            int negate = (*c == '!' || *c == '^');
+            int found = 0;
+            if(negate)
+                c++;
+            //a ] right after the [ is part of the set
+            do{
+                if(c[1] == '-' && c[2] && c[2] != ']'){
+                    if((unsigned char)*name >= (unsigned char)c[0]
+                       && (unsigned char)*name <= (unsigned char)c[2])
+                        found = 1;
+                    c += 3;
+                }
+                else{
+                    if(*c == *name)
+                        found = 1;
+                    c++;
+                }
+            }while(*c && *c != ']');
+            if(found != negate && *c == ']'){
+                pat = c + 1;
+                name++;
+                continue;
+            }
+        }
+        else if(*pat == '?' || (*pat == '\\' && pat[1] == *name) || (*pat != '\\' && *pat == *name)){
+            pat += (*pat == '\\') ? 2 : 1;
+            name++;
+            continue;
+        }
+        //mismatch, let the last * eat one more character
+        if(star_pat == NULL)
+            return 0;
+        pat = star_pat;
+        name = ++star_name;
+    }
+    while(*pat == '*')
+        pat++;
+    return *pat == '\0';
+}
+
+//a pattern component with its backslashes taken out
+char *glob_unescape(const char *s){
+    char *out = (char *)malloc(strlen(s) + 1);
+    char *o = out;
+    for(; *s; s++){
+        if(*s == '\\' && s[1])
+            s++;
+        *o++ = *s;
+    }
+    *o = '\0';
+    return out;
+}
+
+//an entry we can descend into, following symlinks like a plain * does
+int listing_is_dir(const char *base, dir_listing *d, int i, int follow){
+    if(d->types[i] == DT_DIR)
+        return 1;
+    if(d->types[i] != DT_UNKNOWN && !(follow && d->types[i] == DT_LNK))
+        return 0;
+    struct stat st;
+    char *path = glob_join(base, d->names[i]);
+    int r = (follow ? stat(path, &st) : lstat(path, &st)) == 0 && S_ISDIR(st.st_mode);
+    free(path);
+    return r;
+}
+
+//every directory under a ** with the base first, filled by the walkers
+typedef struct glob_walk{
+    char **dirs;
+    int count;
+    int cap;
+    int next;           //first dir nobody has scanned yet
+    int active;         //walkers scanning right now
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} glob_walk;
+
+//scan dirs[i] and queue its subdirectories; ** doesn't follow links or dot dirs
+void walk_one(glob_walk *w, const char *dir){
+    dir_listing *d = get_listing(dir);
+    if(d == NULL)
+        return;
+    for(int k = 0; k < d->count; k++){
+        if(d->names[k][0] == '.' || !listing_is_dir(dir, d, k, 0))
+            continue;
+        char *sub = glob_join(dir, d->names[k]);
+        pthread_mutex_lock(&w->lock);
+        if(w->count == w->cap){
+            w->cap *= 2;
+            w->dirs = (char **)realloc(w->dirs, w->cap * sizeof(char *));
+        }
+        w->dirs[w->count++] = sub;
+        pthread_cond_broadcast(&w->changed);
+        pthread_mutex_unlock(&w->lock);
+    }
+    put_listing(d);
+}
+
+void *walk_thread(void *arg){
+    glob_walk *w = (glob_walk *)arg;
+    pthread_mutex_lock(&w->lock);
+    while(1){
+        while(w->next == w->count && w->active > 0)
+            pthread_cond_wait(&w->changed, &w->lock);
+        if(w->next == w->count)
+            break;      //queue empty and nobody can add to it
+        char *dir = w->dirs[w->next++];
+        w->active++;
+        pthread_mutex_unlock(&w->lock);
+        walk_one(w, dir);
+        pthread_mutex_lock(&w->lock);
+        w->active--;
+        pthread_cond_broadcast(&w->changed);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+//base and every directory below it, walked in parallel once the tree is big
+void walk_tree(const char *base, glob_walk *w){
+    w->cap = 64;
+    w->dirs = (char **)malloc(w->cap * sizeof(char *));
+    w->dirs[0] = strdup(base);
+    w->count = 1;
+    w->next = 0;
+    w->active = 0;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->changed, NULL);
+
+    while(w->next < w->count && w->count < GLOB_PARALLEL_AT){
+        walk_one(w, w->dirs[w->next]);
+        w->next++;
+    }
+    if(w->next < w->count){
+        pthread_t threads[GLOB_THREADS];
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        int started = 0;
+        if(n > GLOB_THREADS)
+            n = GLOB_THREADS;
+        for(int t = 0; t < n; t++){
+            if(pthread_create(&threads[t], NULL, walk_thread, w) == 0)
+                started++;
+        }
+        if(started == 0)
+            walk_thread(w);
+        for(int t = 0; t < started; t++)
+            pthread_join(threads[t], NULL);
+    }
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->changed);
+}
+
+//match comps[i..n) below base, adding whole paths to out
+void glob_at(const char *base, char **comps, int i, int n, glob_list *out){
+    struct stat st;
+
+    if(i == n){
+        if(lstat(base[0] ? base : ".", &st) == 0)
+            glob_add(out, strdup(base));
+        return;
+    }
+    char *comp = comps[i];
+
+    //a trailing / only keeps directories
+    if(comp[0] == '\0'){
+        if(i == n - 1 && stat(base[0] ? base : ".", &st) == 0 && S_ISDIR(st.st_mode))
+            glob_add(out, glob_join(base, ""));
+        return;
+    }
+
+    if(strcmp(comp, "**") == 0){
+        glob_walk w;
+        walk_tree(base, &w);
+        //like bash, a/** starts with a/ itself
+        if(i == n - 1 && base[0])
+            glob_add(out, glob_join(base, ""));
+        for(int k = 0; k < w.count; k++){
+            if(i == n - 1){
+                //** at the end is everything below base
+                dir_listing *d = get_listing(w.dirs[k]);
+                for(int e = 0; d && e < d->count; e++){
+                    if(d->names[e][0] != '.')
+                        glob_add(out, glob_join(w.dirs[k], d->names[e]));
+                }
+                put_listing(d);
+            }
+            else{
+                glob_at(w.dirs[k], comps, i + 1, n, out);
+            }
+            free(w.dirs[k]);
+        }
+        free(w.dirs);
+        return;
+    }
+
+    if(!has_glob_chars(comp)){
+        char *name = glob_unescape(comp);
+        char *next = glob_join(base, name);
+        glob_at(next, comps, i + 1, n, out);
+        free(next);
+        free(name);
+        return;
+    }
+
+    dir_listing *d = get_listing(base);
+    if(d == NULL)
+        return;
+    for(int k = 0; k < d->count; k++){
+        if(!glob_match(comp, d->names[k]))
+            continue;
+        if(i < n - 1 && !listing_is_dir(base, d, k, 1))
+            continue;
+        char *next = glob_join(base, d->names[k]);
+        if(i == n - 1)
+            glob_add(out, next);    //it's in the listing, so it exists
+        else{
+            glob_at(next, comps, i + 1, n, out);
+            free(next);
+        }
+    }
+    put_listing(d);
+}
+
+int glob_cmp(const void *a, const void *b){
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+//every path pattern matches, sorted
+void glob_match_all(const char *pattern, glob_list *out){
+    char *copy = strdup(pattern);
+    char *comps[256];
+    int n = 0;
+    char *c = copy;
+
+    trim_glob_cache();
+    //split on /, an absolute pattern starts from /
+    const char *base = "";
+    if(*c == '/'){
+        base = "/";
+        while(*c == '/')
+            c++;
+    }
+    comps[n++] = c;
+    for(; *c && n < 256; c++){
+        if(*c == '/'){
+            *c = '\0';
+            //a//b is a/b, but keep a trailing / as an empty component
+            while(c[1] == '/')
+                c++;
+            comps[n++] = c + 1;
+        }
+    }
+    int start = out->count;
+    glob_at(base, comps, 0, n, out);
+    qsort(out->paths + start, out->count - start, sizeof(char *), glob_cmp);
+    free(copy);
+}
+
+//words that need pathname expansion: not assignments or redirections
+int is_glob_word(const char *word){
+    if(word[0] == '<' || word[0] == '>' || is_assignment(word))
+        return 0;
+    return has_glob_chars(word);
+}
+
+/* Expand pattern into args[*count...], stopping at max.  Returns how
+   many paths it added, 0 when nothing matched.  */
+int glob_expand(const char *pattern, char **args, int *count, int max){
+    glob_list gl = {NULL, 0, 0};
+    int added = 0;
+
+    glob_match_all(pattern, &gl);
+    for(int k = 0; k < gl.count; k++){
+        if(*count < max){
+            args[(*count)++] = gl.paths[k];
+            added++;
+        }
+        else{
+            free(gl.paths[k]);
+        }
+    }
+    free(gl.paths);
+    return added;
+}
+
+//keep the newest cap bytes, overwriting the oldest
+void ring_write(ring *r, const char *data, size_t n){
+    if(n >= r->cap){
+        r->dropped += r->len + n - r->cap;
+        data += n - r->cap;
+        n = r->cap;
+        r->head = 0;
+        r->len = 0;
+    }
+    if(r->len + n > r->cap){
+        r->dropped += r->len + n - r->cap;
+        r->len = r->cap - n;
+    }
+    size_t first = r->cap - r->head;
+    if(first > n)
+        first = n;
+    memcpy(r->data + r->head, data, first);
+    memcpy(r->data, data + first, n - first);
+    r->head = (r->head + n) % r->cap;
+    r->len += n;
+}
+
+//copy byte i of the held output, 0 being the oldest
+char ring_at(ring *r, size_t i){
+    return r->data[(r->head + r->cap - r->len + i) % r->cap];
+}
+
+void ring_free(ring *r){
+    if(r == NULL)
+        return;
+    shell_unmap(r->data);
+    free(r);
+}
+
+//utility functions for the event loop
+
+void add_watch(int fd, void (*handler)(int fd, void *data), void *data){
+    if(watch_count == watch_cap){
+        watch_cap = watch_cap ? watch_cap * 2 : 16;
+        watches = (watch *)realloc(watches, watch_cap * sizeof(watch));
+        if(watches == NULL){
+            perror("Unable to allocate watches");
+            exit(1);
+        }
+    }
+    watches[watch_count].fd = fd;
+    watches[watch_count].handler = handler;
+    watches[watch_count].data = data;
+    watch_count++;
+}
+
+void remove_watch(int fd){
+    for(int i = 0; i < watch_count; i++){
+        if(watches[i].fd == fd){
+            watches[i] = watches[--watch_count];
+            return;
+        }
+    }
+}
+
+//copy words[start..end) into a new NULL terminated array
+char **copy_words(char **words, int start, int end){
+    char **copy = (char **)malloc(sizeof(char *) * (end - start + 1));
+    if(copy == NULL){
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for(int i = start; i < end; i++){
+        copy[i - start] = strdup(words[i]);
+    }
+    copy[end - start] = NULL;
+    return copy;
+}
+
+void free_words(char **words){
+    if(words == NULL)
+        return;
+    for(int i = 0; words[i]; i++){
+        free(words[i]);
+    }
+    free(words);
+}
+
+/* set -o perf: hardware counters for each process.  The shell opens
+   them on the child after fork, inherited so a stage's own children
+   count too and enabled at its exec, while the child waits on perf_go
+   for us to finish.  They are read when the process is reaped.  Counters
+   the machine or perf_event_paranoid won't give us are left out, the
+   rest still count.  */
+#define PERF_COUNTERS 4
+
+typedef struct perf_event{
+    const char *name;
+    unsigned int type;
+    unsigned long long config;
+} perf_event;
+
+perf_event perf_events[PERF_COUNTERS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+int perf_go[2] = {-1, -1};      //the child reads EOF once its counters are on
+int perf_warned = 0;
+
+/* Put counters on pid, the process p.  on_exec holds them off until it
+   execs, so the shell's part of the child doesn't count.  */
+void perf_attach(process *p, pid_t pid, int on_exec){
+    struct perf_event_attr attr;
+    int err = 0;
+
+    for(int i = 0; i < PERF_COUNTERS; i++){
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.inherit = 1;
+        attr.disabled = on_exec;
+        attr.enable_on_exec = on_exec;
+        attr.exclude_hv = 1;
+        int fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if(fd < 0 && errno == EACCES){
+            //perf_event_paranoid may still allow user space only
+            attr.exclude_kernel = 1;
+            fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        }
+        if(fd < 0){
+            err = errno;
+            continue;
+        }
+        p->perf_fd[i] = fd;
+        p->perf_open |= 1 << i;
+    }
+    if(p->perf_open == 0 && !perf_warned){
+        fprintf(stderr, "wsh: perf counters unavailable: %s\n", strerror(err));
+        perf_warned = 1;
+    }
+}
+
+//p was reaped, take the totals and let the counters go
+void perf_collect(process *p){
+    unsigned long long value[3];    //count, time enabled, time running
+
+    for(int i = 0; i < PERF_COUNTERS; i++){
+        if(!(p->perf_open & (1 << i)))
+            continue;
+        if(read(p->perf_fd[i], value, sizeof(value)) == sizeof(value) && value[2] > 0){
+            //shared with other events, scale up to the whole time
+            if(value[2] < value[1])
+                value[0] = (unsigned long long)((double)value[0] * value[1] / value[2]);
+            p->perf_count[i] = value[0];
+            p->perf_read |= 1 << i;
+        }
+        close(p->perf_fd[i]);
+    }
+    p->perf_open = 0;
+}
+
+//the counters of p on one line, nothing if there are none
+void perf_print(FILE *out, const char *prefix, process *p){
+    if(p->perf_read == 0)
+        return;
+    fprintf(out, "%s", prefix);
+    for(int i = 0; i < PERF_COUNTERS; i++){
+        if(p->perf_read & (1 << i))
+            fprintf(out, " %llu %s", p->perf_count[i], perf_events[i].name);
+    }
+    if((p->perf_read & 3) == 3 && p->perf_count[0] > 0)
+        fprintf(out, " (%.2f IPC)", (double)p->perf_count[1] / p->perf_count[0]);
+    fprintf(out, "\n");
+}
+
+void free_processes(process *p){
+    process *next;
+    for(; p; p = next){
+        next = p->next;
+        perf_collect(p);
+        if(p->pidfd >= 0){
+            remove_watch(p->pidfd);
+            close(p->pidfd);
+        }
+        free_words(p->argv);
+        free_words(p->assigns);
+        for(int i = 0; i < p->nredirs; i++){
+            free(p->redirs[i].path);
+        }
+        free(p->redirs);
+        free(p);
+    }
+}
+
+/* NAME_IN is the fd that writes to coprocess NAME, NAME_OUT the fd
+   that reads its output and NAME_PID its pid.  j NULL unsets them.  */
+void coproc_vars(const char *name, job *j){
+    const char *suffix[3] = { "_IN", "_OUT", "_PID" };
+    char var_name[256];
+    char value[32];
+    for(int i = 0; i < 3; i++){
+        snprintf(var_name, sizeof(var_name), "%s%s", name, suffix[i]);
+        if(j == NULL){
+            unset_var(var_name);
+            continue;
+        }
+        int n = i == 0 ? j->coproc_in : i == 1 ? j->coproc_out : (int)j->first_process->pid;
+        snprintf(value, sizeof(value), "%d", n);
+        set_var(var_name, value, 0);
+    }
+}
+
+//closing the coprocess stdin is how it learns we are done with it
+void close_coproc_input(job *j){
+    if(j->coproc_in >= 0){
+        close(j->coproc_in);
+        j->coproc_in = -1;
+    }
+}
+
+/* Cgroups.  With set -o cgroup (or WSH_CGROUP) every job that starts a
+   process gets a cgroup of its own, <delegated>/wsh-<pid>/<n>, and its
+   processes are forked straight into it.  The delegated directory is
+   WSH_CGROUP when that's a path, else the cgroup the shell was started
+   in.  cpu.max and memory.max are set per job with the cgroup builtin,
+   and jobs shows what the cgroup has used.  Without a cgroup2 tree we
+   can write to, jobs only get their process groups, as before.  */
+int cgroup_root = -1;           //wsh-<pid>, where the jobs' cgroups go
+char cgroup_path[4096];
+pid_t cgroup_owner = 0;         //subshells mustn't remove ours at exit
+int cgroup_serial = 0;
+
+//write value to file in the cgroup dir, 0 or the errno
+int write_cgroup_file(int dir, const char *file, const char *value){
+    int fd = openat(dir, file, O_WRONLY | O_CLOEXEC);
+    int err = 0;
+    if(fd < 0)
+        return errno;
+    if(write(fd, value, strlen(value)) < 0)
+        err = errno;
+    close(fd);
+    return err;
+}
+
+/* The number after key in a cgroup file, the first number in it if key
+   is NULL.  -1 when the file or key isn't there.  */
+long long read_cgroup_value(int dir, const char *file, const char *key){
+    char buf[1024];
+    int fd = openat(dir, file, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(n <= 0)
+        return -1;
+    buf[n] = '\0';
+    if(key == NULL)
+        return buf[0] >= '0' && buf[0] <= '9' ? atoll(buf) : -1;
+    size_t len = strlen(key);
+    for(char *line = buf; line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL){
+        if(strncmp(line, key, len) == 0 && line[len] == ' ')
+            return atoll(line + len + 1);
+    }
+    return -1;
+}
+
+//where the shell's own cgroup is, from /proc/self/cgroup and the cgroup2 mount
+int find_own_cgroup(char *path, size_t len){
+    char line[4096], mount[4096] = "", own[4096] = "";
+    FILE *f = fopen("/proc/self/cgroup", "r");
+
+    if(f == NULL)
+        return -1;
+    while(fgets(line, sizeof(line), f)){
+        if(strncmp(line, "0::", 3) == 0){
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(own, sizeof(own), "%s", line + 3);
+        }
+    }
+    fclose(f);
+    f = fopen("/proc/self/mountinfo", "r");
+    if(f == NULL)
+        return -1;
+    //id parent dev root mountpoint options... - fstype source options
+    while(fgets(line, sizeof(line), f)){
+        char *dash = strstr(line, " - ");
+        char *point;
+        if(dash == NULL || strncmp(dash + 3, "cgroup2 ", 8) != 0)
+            continue;
+        strtok(line, " ");
+        for(int i = 0; i < 3; i++)
+            strtok(NULL, " ");
+        point = strtok(NULL, " ");
+        if(point){
+            snprintf(mount, sizeof(mount), "%s", point);
+            break;
+        }
+    }
+    fclose(f);
+    if(mount[0] == '\0' || own[0] != '/')
+        return -1;
+    snprintf(path, len, "%s%s", mount, strcmp(own, "/") == 0 ? "" : own);
+    return 0;
+}
+
+//take our jobs' cgroups down at exit, the ones still busy stay
+void remove_cgroups(void){
+    char name[32];
+    if(cgroup_root < 0 || getpid() != cgroup_owner)
+        return;
+    for(job *j = first_job; j; j = j->next){
+        if(j->cgroup_fd >= 0){
+            snprintf(name, sizeof(name), "%d", j->cgroup_serial);
+            unlinkat(cgroup_root, name, AT_REMOVEDIR);
+        }
+    }
+    close(cgroup_root);
+    cgroup_root = -1;
+    rmdir(cgroup_path);
+}
+
+/* Make wsh-<pid> under the delegated directory and hand it the cpu and
+   memory controllers, if they are ours to give.  wsh-<pid> itself never
+   holds a process, so it may.  */
+int open_cgroup_root(void){
+    char base[sizeof(cgroup_path) - 32], controllers[256] = "";
+    const char *env = getenv("WSH_CGROUP");
+    int fd;
+
+    if(env && env[0] == '/')
+        snprintf(base, sizeof(base), "%s", env);
+    else if(find_own_cgroup(base, sizeof(base)) < 0){
+        fprintf(stderr, "wsh: cgroup: no cgroup2 hierarchy, jobs only get process groups\n");
+        return -1;
+    }
+    snprintf(cgroup_path, sizeof(cgroup_path), "%s/wsh-%d", base, (int)getpid());
+    if(mkdir(cgroup_path, 0755) < 0 && errno != EEXIST){
+        fprintf(stderr, "wsh: cgroup: %s: %s, jobs only get process groups\n",
+                cgroup_path, strerror(errno));
+        return -1;
+    }
+    cgroup_root = open(cgroup_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(cgroup_root < 0){
+        fprintf(stderr, "wsh: cgroup: %s: %s\n", cgroup_path, strerror(errno));
+        rmdir(cgroup_path);
+        return -1;
+    }
+    fd = openat(cgroup_root, "cgroup.controllers", O_RDONLY | O_CLOEXEC);
+    if(fd >= 0){
+        ssize_t n = read(fd, controllers, sizeof(controllers) - 1);
+        controllers[n > 0 ? n : 0] = '\0';
+        close(fd);
+    }
+    if(strstr(controllers, "cpu"))
+        write_cgroup_file(cgroup_root, "cgroup.subtree_control", "+cpu");
+    if(strstr(controllers, "memory"))
+        write_cgroup_file(cgroup_root, "cgroup.subtree_control", "+memory");
+    if(cgroup_owner == 0)
+        atexit(remove_cgroups);
+    cgroup_owner = getpid();
+    return 0;
+}
+
+//set one of the job's cgroup files, complaining the way the builtin does
+int set_cgroup_file(int dir, const char *file, const char *value){
+    int err = write_cgroup_file(dir, file, value);
+    if(err == ENOENT)
+        fprintf(stderr, "wsh: cgroup: %s: controller not delegated to us\n", file);
+    else if(err)
+        fprintf(stderr, "wsh: cgroup: %s: %s\n", file, strerror(err));
+    return err ? -1 : 0;
+}
+
+/* Give j a cgroup if set -o cgroup or the cgroup builtin asked for one.
+   Any failure leaves j with just its process group.  */
+void make_job_cgroup(job *j){
+    char name[32];
+    int asked = next_cgroup;
+
+    next_cgroup = 0;
+    if(!cgroup_on && !asked)
+        return;
+    if(cgroup_root < 0 && open_cgroup_root() < 0){
+        //said why once, don't again for every job
+        cgroup_on = 0;
+        return;
+    }
+    snprintf(name, sizeof(name), "%d", ++cgroup_serial);
+    if(mkdirat(cgroup_root, name, 0755) < 0){
+        fprintf(stderr, "wsh: cgroup: %s/%s: %s\n", cgroup_path, name, strerror(errno));
+        return;
+    }
+    j->cgroup_fd = openat(cgroup_root, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(j->cgroup_fd < 0){
+        fprintf(stderr, "wsh: cgroup: %s/%s: %s\n", cgroup_path, name, strerror(errno));
+        unlinkat(cgroup_root, name, AT_REMOVEDIR);
+        return;
+    }
+    j->cgroup_serial = cgroup_serial;
+    if(asked && next_cpu_max[0])
+        set_cgroup_file(j->cgroup_fd, "cpu.max", next_cpu_max);
+    if(asked && next_memory_max[0])
+        set_cgroup_file(j->cgroup_fd, "memory.max", next_memory_max);
+}
+
+//j is done with its cgroup, it goes once nothing is left in it
+void remove_job_cgroup(job *j){
+    char name[32];
+    if(j->cgroup_fd < 0)
+        return;
+    close(j->cgroup_fd);
+    j->cgroup_fd = -1;
+    if(cgroup_root >= 0){
+        snprintf(name, sizeof(name), "%d", j->cgroup_serial);
+        unlinkat(cgroup_root, name, AT_REMOVEDIR);
+    }
+}
+
+/* fork() straight into the cgroup behind dir, so the child is never
+   counted anywhere else.  A raw clone3 skips what glibc's fork does
+   for other threads, so it is only used while there are none: a lock
+   another thread held would stay held in the child for good.  Then, or
+   on a kernel without clone3, it's a plain fork and the child moves
+   itself in before it does anything else.  */
+pid_t fork_into_cgroup(int dir){
+    struct clone_args args;
+    pid_t pid;
+
+    if(helper_threads == 0){
+        memset(&args, 0, sizeof(args));
+        args.flags = CLONE_INTO_CGROUP;
+        args.exit_signal = SIGCHLD;
+        args.cgroup = dir;
+        pid = syscall(SYS_clone3, &args, sizeof(args));
+        if(pid >= 0 || errno == EAGAIN || errno == ENOMEM)
+            return pid;
+    }
+    pid = fork();
+    if(pid == 0)
+        write_cgroup_file(dir, "cgroup.procs", "0");
+    return pid;
+}
+
+//what j's cgroup has used so far, for jobs
+void print_cgroup_usage(job *j){
+    long long cpu, user, sys, memory, peak;
+    if(j->cgroup_fd < 0)
+        return;
+    cpu = read_cgroup_value(j->cgroup_fd, "cpu.stat", "usage_usec");
+    user = read_cgroup_value(j->cgroup_fd, "cpu.stat", "user_usec");
+    sys = read_cgroup_value(j->cgroup_fd, "cpu.stat", "system_usec");
+    memory = read_cgroup_value(j->cgroup_fd, "memory.current", NULL);
+    peak = read_cgroup_value(j->cgroup_fd, "memory.peak", NULL);
+    printf("      cgroup %s/%d:", cgroup_path, j->cgroup_serial);
+    if(cpu >= 0)
+        printf(" cpu %.2fs (user %.2fs sys %.2fs)", cpu / 1e6, user / 1e6, sys / 1e6);
+    if(memory >= 0)
+        printf(" memory %.1f MiB", memory / 1048576.0);
+    if(peak >= 0)
+        printf(" peak %.1f MiB", peak / 1048576.0);
+    printf("\n");
+}
+
+//the job is over, its deadline with it
+void stop_job_timer(job *j){
+    if(j->timer_fd >= 0){
+        remove_watch(j->timer_fd);
+        close(j->timer_fd);
+        j->timer_fd = -1;
+    }
+}
+
+void free_job(job *j){
+    stop_job_timer(j);
+    free(j->limits);
+    remove_job_cgroup(j);
+    if(j->capture_fd >= 0){
+        remove_watch(j->capture_fd);
+        close(j->capture_fd);
+    }
+    ring_free(j->output);
+    if(j->coproc_name){
+        close_coproc_input(j);
+        if(j->coproc_out >= 0)
+            close(j->coproc_out);
+        coproc_vars(j->coproc_name, NULL);
+        free(j->coproc_name);
+    }
+    free_processes(j->first_process);
+    free(j->command);
+    free(j);
+}
+
+//utility functions for operating job objects
+
+//find active job
+job *
+find_job (pid_t pgid){
+    job *j;
+    for (j = first_job; j; j=j->next){
+        if(j->pgid == pgid)
+            return j;
+    }
+    return NULL;
+}
+
+//return true if all process in job is stooped or completed
+int
+job_is_stopped (job *j){
+    process *p;
+    for(p= j->first_process; p; p=p->next){
+        if(!p->completed && !p->stopped)
+            return 0;
+    }
+    return 1;
+}
+
+//return true if all processes in job have completed
+int
+job_is_completed(job *j){
+    process *p;
+    for(p = j->first_process; p; p = p->next){
+        if(!p->completed)
+            return 0;
+    }
+    return 1;
+}
+
+//exit status of one process the way $? reports it
+int
+process_exit_status(process *p){
+    if(WIFEXITED(p->status))
+        return WEXITSTATUS(p->status);
+    if(WIFSIGNALED(p->status))
+        return 128 + WTERMSIG(p->status);
+    return 0;
+}
+
+/* Exit status of a job: its last process, or with pipefail the last
+   process that failed.  A stage that never started wins.  */
+int
+job_exit_status(job *j){
+    process *p;
+    int status = 0;
+    if(j->launch_status)
+        return j->launch_status;
+    if(j->timed_out)
+        return 124;
+    for(p = j->first_process; p; p = p->next){
+        int s = process_exit_status(p);
+        if(!pipefail || s != 0)
+            status = s;
+    }
+    return status;
+}
+
+//PIPESTATUS holds every stage's status, separated by spaces
+void
+set_pipestatus(job *j){
+    char text[1024];
+    size_t len = 0;
+    process *p;
+    text[0] = '\0';
+    for(p = j->first_process; p && len < sizeof(text) - 16; p = p->next){
+        len += snprintf(text + len, sizeof(text) - len, "%s%d",
+                        len ? " " : "", process_exit_status(p));
+    }
+    set_var("PIPESTATUS", text, 0);
+}
+
+/* With set -o status the job table is published in /dev/shm/wsh-<pid>
+   for monitors to read without syscalls: a header and fixed-size
+   records, one per job.  Each record is guarded by a seqlock, seq is odd
+   while we write it, and a reader keeps its copy only if seq was even
+   and the same before and after.  wshstat.c reads it, the layout there
+   has to match this one.  */
+#define STATUS_MAGIC 0x57534853     //"WSHS"
+#define STATUS_VERSION 1
+#define STATUS_SLOTS 64
+#define STATUS_COMMAND 96           //bytes of the command line kept
+
+#define STATUS_FREE 0
+#define STATUS_RUNNING 1
+#define STATUS_STOPPED 2
+#define STATUS_DONE 3
+
+typedef struct status_record{
+    uint32_t seq;
+    int32_t id;                 //job id, 0 for a free slot
+    int32_t pgid;
+    int32_t state;
+    int32_t processes;          //stages in the job
+    int32_t exit_status;        //once done
+    int64_t start_ns;           //realtime clock
+    int64_t utime_us;           //summed over the stages reaped so far
+    int64_t stime_us;
+    int64_t maxrss_kb;          //largest of them
+    char command[STATUS_COMMAND];
+} status_record;
+
+typedef struct status_page{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t record_size;
+    int32_t shell_pid;
+    uint32_t dropped;           //jobs that found every slot taken
+    status_record records[STATUS_SLOTS];
+} status_page;
+
+status_page *status_map = NULL;
+pid_t status_owner = 0;         //subshells mustn't remove our page at exit
+
+void remove_status_page(void){
+    char name[64];
+    if(status_map == NULL || getpid() != status_owner)
+        return;
+    snprintf(name, sizeof(name), "/dev/shm/wsh-%d", (int)status_owner);
+    unlink(name);
+    munmap(status_map, sizeof(status_page));
+    status_map = NULL;
+}
+
+//make the page the first time a job is published
+int open_status_page(void){
+    char name[64];
+    int fd;
+
+    /* /dev/shm is anyone's to write in: never follow or reuse a name we
+       didn't just make, and keep our command lines to ourselves.  A page
+       left by a killed shell that had our pid is ours to remove.  */
+    snprintf(name, sizeof(name), "/dev/shm/wsh-%d", (int)getpid());
+    fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if(fd < 0 && errno == EEXIST && unlink(name) == 0)
+        fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if(fd < 0 || ftruncate(fd, sizeof(status_page)) < 0){
+        perror(name);
+        if(fd >= 0)
+            close(fd);
+        status_on = 0;
+        return -1;
+    }
+    void *map = mmap(NULL, sizeof(status_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED){
+        perror(name);
+        unlink(name);
+        status_on = 0;
+        return -1;
+    }
+    //a forked child must never write our records
+    madvise(map, sizeof(status_page), MADV_DONTFORK);
+    status_map = (status_page *)map;
+    status_map->slots = STATUS_SLOTS;
+    status_map->record_size = sizeof(status_record);
+    status_map->shell_pid = getpid();
+    __atomic_store_n(&status_map->version, STATUS_VERSION, __ATOMIC_RELAXED);
+    __atomic_store_n(&status_map->magic, STATUS_MAGIC, __ATOMIC_RELEASE);
+    if(status_owner == 0)
+        atexit(remove_status_page);
+    status_owner = getpid();
+    return 0;
+}
+
+//bracket the writes to r, seq is odd in between
+void status_write_begin(status_record *r){
+    __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void status_write_end(status_record *r){
+    __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELEASE);
+}
+
+//write j's record as it stands now
+void publish_job(job *j){
+    status_record *r;
+    struct timespec now;
+
+    if(!status_on)
+        return;
+    if(status_map == NULL && open_status_page() < 0)
+        return;
+    if(j->status_slot < 0){
+        for(int i = 0; i < STATUS_SLOTS; i++){
+            if(status_map->records[i].id == 0){
+                j->status_slot = i;
+                break;
+            }
+        }
+        if(j->status_slot < 0){
+            status_map->dropped++;
+            j->status_slot = STATUS_SLOTS;  //don't look again
+            return;
+        }
+        r = &status_map->records[j->status_slot];
+        clock_gettime(CLOCK_REALTIME, &now);
+        status_write_begin(r);
+        r->start_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+        snprintf(r->command, sizeof(r->command), "%s", j->command);
+    }
+    else if(j->status_slot == STATUS_SLOTS){
+        return;
+    }
+    else{
+        r = &status_map->records[j->status_slot];
+        status_write_begin(r);
+    }
+
+    r->id = j->id;
+    r->pgid = j->pgid ? j->pgid : getpgrp();    //non-interactive jobs stay in ours
+    r->processes = 0;
+    r->utime_us = 0;
+    r->stime_us = 0;
+    r->maxrss_kb = 0;
+    for(process *p = j->first_process; p; p = p->next){
+        r->processes++;
+        if(!p->completed)
+            continue;
+        r->utime_us += p->usage.ru_utime.tv_sec * 1000000LL + p->usage.ru_utime.tv_usec;
+        r->stime_us += p->usage.ru_stime.tv_sec * 1000000LL + p->usage.ru_stime.tv_usec;
+        if(p->usage.ru_maxrss > r->maxrss_kb)
+            r->maxrss_kb = p->usage.ru_maxrss;
+    }
+    if(job_is_completed(j)){
+        r->state = STATUS_DONE;
+        r->exit_status = job_exit_status(j);
+    }
+    else{
+        r->state = job_is_stopped(j) ? STATUS_STOPPED : STATUS_RUNNING;
+        r->exit_status = 0;
+    }
+    status_write_end(r);
+}
+
+//free j's record once the job is gone
+void unpublish_job(job *j){
+    if(status_map == NULL || j->status_slot < 0 || j->status_slot == STATUS_SLOTS)
+        return;
+    status_record *r = &status_map->records[j->status_slot];
+    status_write_begin(r);
+    r->id = 0;
+    r->state = STATUS_FREE;
+    r->command[0] = '\0';
+    status_write_end(r);
+    j->status_slot = -1;
+}
+
+int write_all(int fd, const char *data, size_t len){
+    while(len > 0){
+        ssize_t n = write(fd, data, len);
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* With WSH_JOURNAL set to a file, every job that forks gets a start and
+   an end record appended to it, in binary: a few dozen bytes a job
+   instead of a line of text.  A command's text is written once, the
+   start records point at it by file offset.  Records gather in one of
+   two buffers, a thread writes a full one (or whatever is there after a
+   second) while the shell fills the other.  The journal is locked for
+   the whole session so our offsets stay right, a %p in the name is
+   replaced by our pid to give each shell its own.  wshjournal.c turns it
+   into CSV, the layout there has to match this one.  */
+#define JOURNAL_MAGIC "WSHJRNL1"
+#define JOURNAL_BUFFER 65536
+#define JOURNAL_FLUSH_MS 1000
+#define JOURNAL_TEXTS 4096          //commands whose text we remember writing
+
+#define JOURNAL_TEXT 1
+#define JOURNAL_START 2
+#define JOURNAL_END 3
+
+//every record starts with this, size counts the whole record
+typedef struct journal_head{
+    uint8_t type;
+    uint8_t flags;
+    uint16_t size;
+    uint32_t job;               //journal_id, unique in one shell's session
+} journal_head;
+
+typedef struct journal_text{
+    journal_head head;
+    uint64_t hash;
+    //then size - sizeof(journal_text) bytes of command, no NUL
+} journal_text;
+
+typedef struct journal_start{
+    journal_head head;
+    uint64_t hash;              //of the command line, argv joined
+    uint64_t text;              //file offset of its journal_text
+    int64_t time_ns;            //realtime clock
+    int32_t pgid;
+    int32_t shell_pid;
+} journal_start;
+
+typedef struct journal_end{
+    journal_head head;
+    int32_t status;
+    int32_t processes;
+    int64_t duration_ns;
+    int64_t utime_us;           //summed over the processes
+    int64_t stime_us;
+    int64_t maxrss_kb;          //largest of them
+} journal_end;
+
+typedef struct journal_seen{
+    uint64_t hash;
+    uint64_t offset;
+} journal_seen;
+
+char journal_name[4096];        //the file we have open, "" for none
+int journal_fd = -1;
+int journal_off = 0;            //set in subshells, they leave it to us
+pid_t journal_owner = 0;
+unsigned long long journal_size;    //file size once everything queued is written
+unsigned int journal_next_id = 0;
+journal_seen journal_texts[JOURNAL_TEXTS];
+
+char *journal_fill;             //buffer records are added to
+size_t journal_len;
+char *journal_spare;            //the other one, NULL while the thread writes it
+char *journal_out;              //handed to the thread
+size_t journal_out_len;
+long long journal_since;        //when journal_fill got its first byte
+int journal_stop;
+pthread_t journal_thread;
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_wake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t journal_done = PTHREAD_COND_INITIALIZER;
+
+//give the filled buffer to the thread, journal_lock held and journal_spare free
+void journal_hand_off(void){
+    journal_out = journal_fill;
+    journal_out_len = journal_len;
+    journal_fill = journal_spare;
+    journal_spare = NULL;
+    journal_len = 0;
+    pthread_cond_signal(&journal_wake);
+}
+
+//the writer: full buffers as they come, or whatever has waited a second
+void *journal_writer(void *unused){
+    pthread_mutex_lock(&journal_lock);
+    for(;;){
+        if(journal_out){
+            char *data = journal_out;
+            size_t len = journal_out_len;
+            pthread_mutex_unlock(&journal_lock);
+            if(write_all(journal_fd, data, len) < 0)
+                perror("wsh: journal");
+            pthread_mutex_lock(&journal_lock);
+            journal_spare = data;
+            journal_out = NULL;
+            pthread_cond_broadcast(&journal_done);
+            continue;
+        }
+        if(journal_len && (journal_stop || now_ns() - journal_since >= JOURNAL_FLUSH_MS * 1000000LL)){
+            journal_hand_off();
+            continue;
+        }
+        if(journal_stop)
+            break;
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += JOURNAL_FLUSH_MS / 1000;
+        pthread_cond_timedwait(&journal_wake, &journal_lock, &until);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return NULL;
+}
+
+//write out what's queued and close the journal
+void close_journal(void){
+    if(journal_fd < 0 || getpid() != journal_owner)
+        return;
+    pthread_mutex_lock(&journal_lock);
+    journal_stop = 1;
+    pthread_cond_signal(&journal_wake);
+    pthread_mutex_unlock(&journal_lock);
+    pthread_join(journal_thread, NULL);
+    helper_threads--;
+    close(journal_fd);
+    journal_fd = -1;
+    journal_name[0] = '\0';
+    free(journal_fill);
+    free(journal_spare);
+}
+
+/* Is the journal WSH_JOURNAL names open?  Opens it, or moves to another
+   file if the variable changed.  */
+int journal_ready(void){
+    char name[4096];
+    char *value = get_var("WSH_JOURNAL");
+    size_t len = 0;
+
+    if(journal_off)
+        return 0;
+    if(value == NULL || value[0] == '\0'){
+        close_journal();
+        return 0;
+    }
+    for(char *c = value; *c && len < sizeof(name) - 16; c++){
+        if(c[0] == '%' && c[1] == 'p'){
+            len += snprintf(name + len, sizeof(name) - len, "%d", (int)getpid());
+            c++;
+        }
+        else
+            name[len++] = *c;
+    }
+    name[len] = '\0';
+    if(journal_fd >= 0 && strcmp(name, journal_name) == 0)
+        return 1;
+    close_journal();
+
+    struct stat st;
+    int fd = open(name, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0 || flock(fd, LOCK_EX | LOCK_NB) < 0 || fstat(fd, &st) < 0){
+        if(errno == EWOULDBLOCK)
+            fprintf(stderr, "wsh: %s: journal in use by another shell, a %%p in WSH_JOURNAL gives each its own\n", name);
+        else
+            perror(name);
+        if(fd >= 0)
+            close(fd);
+        set_var("WSH_JOURNAL", "", 0);
+        return 0;
+    }
+    if(st.st_size == 0 && write_all(fd, JOURNAL_MAGIC, 8) < 0){
+        perror(name);
+        close(fd);
+        set_var("WSH_JOURNAL", "", 0);
+        return 0;
+    }
+    journal_fd = fd;
+    journal_size = st.st_size ? st.st_size : 8;
+    strcpy(journal_name, name);
+    memset(journal_texts, 0, sizeof(journal_texts));
+    journal_fill = (char *)malloc(JOURNAL_BUFFER);
+    journal_spare = (char *)malloc(JOURNAL_BUFFER);
+    journal_len = 0;
+    journal_out = NULL;
+    journal_stop = 0;
+    if(pthread_create(&journal_thread, NULL, journal_writer, NULL) != 0){
+        perror("wsh: journal");
+        exit(1);
+    }
+    helper_threads++;
+    if(journal_owner == 0)
+        atexit(close_journal);
+    journal_owner = getpid();
+    return 1;
+}
+
+//queue one record, returns where in the file it will be
+unsigned long long journal_add(const void *record, size_t len){
+    pthread_mutex_lock(&journal_lock);
+    while(journal_len + len > JOURNAL_BUFFER){
+        //both buffers busy, only then does the shell wait on the disk
+        if(journal_spare)
+            journal_hand_off();
+        else
+            pthread_cond_wait(&journal_done, &journal_lock);
+    }
+    if(journal_len == 0)
+        journal_since = now_ns();
+    memcpy(journal_fill + journal_len, record, len);
+    journal_len += len;
+    unsigned long long at = journal_size;
+    journal_size += len;
+    pthread_mutex_unlock(&journal_lock);
+    return at;
+}
+
+void journal_job_start(job *j){
+    journal_start r;
+    uint64_t hash = 14695981039346656037ull;
+
+    if(!journal_ready())
+        return;
+    for(const char *c = j->command; *c; c++){
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ull;
+    }
+    j->journal_id = ++journal_next_id;
+
+    //the text goes in once, unless it was pushed out of the table since
+    journal_seen *seen = &journal_texts[hash % JOURNAL_TEXTS];
+    if(seen->hash != hash || seen->offset == 0){
+        struct {
+            journal_text head;
+            char command[4096];
+        } t;
+        size_t len = strlen(j->command);
+        if(len > sizeof(t.command))
+            len = sizeof(t.command);
+        t.head.head.type = JOURNAL_TEXT;
+        t.head.head.flags = 0;
+        t.head.head.size = sizeof(journal_text) + len;
+        t.head.head.job = j->journal_id;
+        t.head.hash = hash;
+        memcpy(t.command, j->command, len);
+        seen->hash = hash;
+        seen->offset = journal_add(&t, t.head.head.size);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    memset(&r, 0, sizeof(r));
+    r.head.type = JOURNAL_START;
+    r.head.size = sizeof(r);
+    r.head.job = j->journal_id;
+    r.hash = hash;
+    r.text = seen->offset;
+    r.time_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    r.pgid = j->pgid ? j->pgid : getpgrp();
+    r.shell_pid = getpid();
+    journal_add(&r, sizeof(r));
+}
+
+void journal_job_end(job *j){
+    journal_end r;
+
+    if(j->journal_id == 0 || journal_fd < 0 || journal_off)
+        return;
+    memset(&r, 0, sizeof(r));
+    r.head.type = JOURNAL_END;
+    r.head.size = sizeof(r);
+    r.head.job = j->journal_id;
+    r.status = job_exit_status(j);
+    r.duration_ns = (j->completed_ns ? j->completed_ns : now_ns()) - j->launched_ns;
+    for(process *p = j->first_process; p; p = p->next){
+        r.processes++;
+        r.utime_us += p->usage.ru_utime.tv_sec * 1000000LL + p->usage.ru_utime.tv_usec;
+        r.stime_us += p->usage.ru_stime.tv_sec * 1000000LL + p->usage.ru_stime.tv_usec;
+        if(p->usage.ru_maxrss > r.maxrss_kb)
+            r.maxrss_kb = p->usage.ru_maxrss;
+    }
+    journal_add(&r, sizeof(r));
+    j->journal_id = 0;
+}
+
+/* With set -o teardown, once stage p of j exits the stages feeding it
+   are told to stop instead of running on until their next write.  */
+void
+teardown_upstream(job *j, process *done){
+    process *p;
+    for(p = j->first_process; p && p != done; p = p->next){
+        if(p->pid > 0 && !p->completed)
+            kill(p->pid, SIGPIPE);
+    }
+}
+
+/* Store the status of the process pid that was returned by waitpid.
+   Return 0 if all went well, nonzero otherwise.  */
+
+int
+mark_process_status (pid_t pid, int status, struct rusage *usage)
+{
+  job *j;
+  process *p;
+
+  if (pid > 0)
+    {
+      /* Update the record for the process.  */
+      for (j = first_job; j; j = j->next)
+        for (p = j->first_process; p; p = p->next)
+          if (p->pid == pid)
+            {
+              p->status = status;
+              if (usage)
+                p->usage = *usage;
+              if (WIFSTOPPED (status))
+                p->stopped = 1;
+              else
+                {
+                  p->completed = 1;
+                  if (p->started_ns)
+                    hist_record (&stats.exec_reap, now_ns () - p->started_ns);
+                  if (job_is_completed (j))
+                    {
+                      stop_job_timer (j);
+                      j->completed_ns = now_ns ();
+                      stats.jobs_reaped++;
+                      journal_job_end (j);
+                    }
+                  perf_collect (p);
+                  /* SIGPIPE is how pipelines normally wind down, and a
+                     SIGTERM from teardown_job was our own doing.  */
+                  if (WIFSIGNALED (status) && WTERMSIG (status) != SIGPIPE
+                      && !(p->torn_down && WTERMSIG (status) == SIGTERM))
+                    fprintf (stderr, "%d: Terminated by signal %d.\n",
+                             (int) pid, WTERMSIG (p->status));
+                  if (pipe_teardown && p != j->first_process)
+                    teardown_upstream (j, p);
+                }
+              publish_job (j);
+              return 0;
+             }
+      fprintf (stderr, "No child process %d.\n", pid);
+      return -1;
+    }
+  else if (pid == 0 || errno == ECHILD)
+    /* No processes ready to report.  */
+    return -1;
+  else {
+    /* Other weird errors.  */
+    perror ("waitpid");
+    return -1;
+  }
+}
+
+/* Check for processes that have status information available,
+   without blocking.  */
+
+void
+update_status (void)
+{
+  int status;
+  pid_t pid;
+  struct rusage usage;
+
+  /* Keep going past pids we don't know, there may be more behind them.  */
+  while ((pid = wait4 (WAIT_ANY, &status, WUNTRACED|WNOHANG, &usage)) > 0)
+    mark_process_status (pid, status, &usage);
+}
+
+//SIGCHLD only pokes the self-pipe, the reaping happens in the loop
+void sig_child_handler(int sig_child){
+    int saved = errno;
+    char c = 0;
+    write(sigchld_pipe[1], &c, 1);
+    errno = saved;
+}
+
+//the self-pipe became readable: empty it and reap
+void reap_children(int fd, void *data){
+    char drain[64];
+    while(read(fd, drain, sizeof(drain)) > 0)
+        ;
+    update_status();
+}
+
+/* Poll the watched fds, and input_fd if it is not -1, for up to timeout
+   ms and run the handlers of the ones that are ready.
+   Returns 1 when input_fd is readable.  */
+int run_events(int input_fd, int timeout){
+    struct pollfd fds[watch_count + 1];
+    int n = 0;
+    int count = watch_count;
+    int input_ready = 0;
+
+    for(int i = 0; i < count; i++){
+        fds[n].fd = watches[i].fd;
+        fds[n].events = POLLIN;
+        n++;
+    }
+    if(input_fd >= 0){
+        fds[n].fd = input_fd;
+        fds[n].events = POLLIN;
+        n++;
+    }
+    if(poll(fds, n, timeout) <= 0)
+        return 0;   //timed out or interrupted, callers loop
+
+    if(input_fd >= 0 && fds[n - 1].revents)
+        input_ready = 1;
+    //handlers may add or remove watches, so look each fd up again
+    for(int i = 0; i < count; i++){
+        if(fds[i].revents == 0)
+            continue;
+        for(int w = 0; w < watch_count; w++){
+            if(watches[w].fd == fds[i].fd){
+                watches[w].handler(watches[w].fd, watches[w].data);
+                break;
+            }
+        }
+    }
+    return input_ready;
+}
+
+/* Read the next line from in into buffer, running the event loop while
+   waiting for it.  Returns the line length or -1 at end of input.  */
+ssize_t read_line(line_reader *in){
+    while(1){
+        char *base = in->data + in->start;
+        char *nl = memchr(base, '\n', in->len - in->start);
+        if(nl != NULL || (in->eof && in->len > in->start)){
+            size_t n = (nl ? nl + 1 : in->data + in->len) - base;
+            if(n + 1 > bufsize){
+                bufsize = n + 1;
+                buffer = (char *)realloc(buffer, bufsize);
+            }
+            memcpy(buffer, base, n);
+            buffer[n] = '\0';
+            in->start += n;
+            return n;
+        }
+        if(in->eof){
+            return -1;
+        }
+
+        //slide what is left to the front and make room for more
+        memmove(in->data, base, in->len - in->start);
+        in->len -= in->start;
+        in->start = 0;
+        if(in->len == in->cap){
+            in->cap = in->cap ? in->cap * 2 : 4096;
+            in->data = (char *)realloc(in->data, in->cap);
+        }
+
+        if(!run_events(in->fd, -1)){
+            continue;
+        }
+        ssize_t got = read(in->fd, in->data + in->len, in->cap - in->len);
+        if(got > 0){
+            in->len += got;
+        }
+        else if(got == 0 || (errno != EINTR && errno != EAGAIN)){
+            in->eof = 1;
+        }
+    }
+}
+
+/* Keep the event loop running until all processes in the given job
+   have reported.  SIGCHLD wakes the loop and reap_children() records
+   their status.  */
+
+void
+wait_for_job (job *j)
+{
+  while (!job_is_stopped (j) && !job_is_completed (j))
+    run_events (-1, -1);
+}
+
+/* Format information about job status for the user to look at.  */
+
+void
+format_job_info (job *j, const char *status)
+{
+  fprintf (stderr, "%ld (%s): %s\n", (long)j->pgid, status, j->command);
+}
+
+/* The user has just heard that j finished, how long after did that take.  */
+void
+notified_job (job *j)
+{
+  if (j->completed_ns)
+    hist_record (&stats.notify, now_ns () - j->completed_ns);
+}
+
+/* With set -o perf, what each process of the finished job j counted.  */
+void
+perf_report (job *j)
+{
+  char prefix[64];
+
+  for (process *p = j->first_process; p; p = p->next)
+    {
+      snprintf (prefix, sizeof (prefix), "perf: %.40s:", p->argv[0]);
+      perf_print (stderr, prefix, p);
+    }
+}
+
+/* Background jobs that finished and were reported before anyone ran
+   wait on them.  wait %N still gets their status from here, once, until
+   the id is handed to a new job.  */
+#define DONE_JOBS 64
+
+struct done_job
+{
+  int id;
+  int status;
+} done_jobs[DONE_JOBS];
+int ndone_jobs;
+
+/* Take id's remembered status out, returning -1 if there is none.  */
+int
+forget_done_job (int id)
+{
+  for (int i = 0; i < ndone_jobs; i++)
+    if (done_jobs[i].id == id)
+      {
+        int status = done_jobs[i].status;
+        memmove (done_jobs + i, done_jobs + i + 1, (ndone_jobs - i - 1) * sizeof (done_jobs[0]));
+        ndone_jobs--;
+        return status;
+      }
+  return -1;
+}
+
+void
+remember_done_job (job *j)
+{
+  if (!j->curr_bg)
+    return;
+  forget_done_job (j->id);
+  if (ndone_jobs == DONE_JOBS)
+    {
+      memmove (done_jobs, done_jobs + 1, (DONE_JOBS - 1) * sizeof (done_jobs[0]));
+      ndone_jobs--;
+    }
+  done_jobs[ndone_jobs].id = j->id;
+  done_jobs[ndone_jobs].status = job_exit_status (j);
+  ndone_jobs++;
+}
+
+/* Notify the user about stopped or terminated jobs.
+   Delete terminated jobs from the active job list.  */
+
+void
+do_job_notification (void)
+{
+  job *j, *jlast, *jnext;
+
+  /* Update status information for child processes.  */
+  update_status ();
+
+  jlast = NULL;
+  for (j = first_job; j; j = jnext)
+    {
+      jnext = j->next;
+
+      /* If all processes have completed, tell the user the job has
+         completed and delete it from the list of active jobs.  */
+      if (job_is_completed (j)) {
+        if (!j->notified)
+          {
+            format_job_info (j, "completed");
+            perf_report (j);
+            notified_job (j);
+          }
+        j->notified = 1;
+        /* Captured output stays around until the pipe is drained and
+           someone has looked at it.  */
+        if (j->capture_fd >= 0 || (j->output && !j->output_shown))
+          jlast = j;
+        else {
+          if (jlast)
+            jlast->next = jnext;
+          else
+            first_job = jnext;
+          if (current_job == j)
+            current_job = jlast;
+          if (!j->waited)
+            remember_done_job (j);
+          unpublish_job (j);
+          free_job (j);
+        }
+      }
+
+      /* Notify the user about stopped jobs,
+         marking them so that we won’t do this more than once.  */
+      else if (job_is_stopped (j) && !j->notified) {
+        format_job_info (j, "stopped");
+        j->notified = 1;
+        jlast = j;
+      }
+
+      /* Don’t say anything about jobs that are still running.  */
+      else
+        jlast = j;
+    }
+}
+
+
+/* Put a job in the background.  If the cont argument is true, send
+   the process group a SIGCONT signal to wake it up.  */
+
+void
+put_job_in_background (job *j, int cont)
+{
+  /* Send the job a continue signal, if necessary.  */
+  if (cont)
+    if (kill (-j->pgid, SIGCONT) < 0)
+      perror ("kill (SIGCONT)");
+}
+
+void
+put_job_in_foreground (job *j, int cont)
+{
+  /* Put the job into the foreground.  */
+  tcsetpgrp (shell_terminal, j->pgid);
+
+  /* Send the job a continue signal, if necessary.  */
+  if (cont)
+    {
+      tcsetattr (shell_terminal, TCSADRAIN, &j->tmodes);
+      if (kill (- j->pgid, SIGCONT) < 0)
+        perror ("kill (SIGCONT)");
+    }
+
+  /* Wait for it to report.  */
+  wait_for_job (j);
+
+  /* Put the shell back in the foreground.  */
+  tcsetpgrp (shell_terminal, shell_pgid);
+
+  /* Restore the shell’s terminal modes.  */
+  tcgetattr (shell_terminal, &j->tmodes);
+  tcsetattr (shell_terminal, TCSADRAIN, &shell_tmodes);
+}
+
+
+
+void setup(){
+
+    //give space for the buffer
+    buffer = (char *)malloc(bufsize * sizeof(char));
+    if( buffer == NULL)
+    {
+        perror("Unable to allocate buffer");
+        exit(1);
+    }
+    // // Initialize jobs array
+    // for (int i = 0; i < 256; i++) {
+    //     job[i].id = -1;
+    // }
+
+    //ADD CODE do i need to handle end of file for both modes 
+}
+
+/* will set some global vars and make sure forks will go offf our 
+*  current shell and not make its own one
+*/
+void init_shell(){
+    //make sure we are running interactively
+    shell_terminal = STDIN_FILENO;
+    shell_is_interactive = want_terminal && isatty(shell_terminal);
+
+    //children are reaped from the event loop, SIGCHLD just wakes it up
+    struct sigaction sa;
+    if(pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) < 0){
+        perror("pipe");
+        exit(1);
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sig_child_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+    add_watch(sigchld_pipe[0], reap_children, NULL);
+
+    if(shell_is_interactive){
+        //loop until we are in the fg
+        while(tcgetpgrp(shell_terminal) != (shell_pgid = getpgrp())){
+            kill(-shell_pgid, SIGTTIN); //kills all processes with pid if pid negative
+        }
+
+        /* Ignore interactive and job-control signals.  */
+        signal (SIGINT, SIG_IGN); //will need to set all these back to defualt for forks
+        signal (SIGQUIT, SIG_IGN);
+        signal (SIGTSTP, SIG_IGN);
+        signal (SIGTTIN, SIG_IGN);
+        signal (SIGTTOU, SIG_IGN);
+
+        //put the shell in its own process group 
+        shell_pgid = getpid();
+        //a session leader already leads its own group and can't move
+        if(shell_pgid != getsid(0) && setpgid(shell_pgid, shell_pgid) < 0) //returns -1 error
+        {
+          perror ("Couldn't put the shell in its own process group");
+          exit (1);
+        }
+        // Grab control of the terminal.  set to foreground
+        tcsetpgrp (shell_terminal, shell_pgid);
+
+        /* Save default terminal attributes for shell.  */
+        tcgetattr (shell_terminal, &shell_tmodes);
+    }
+}
+
+/* fanout [-n N] [-k] [-b BYTES] cmd [args...]
+
+   Runs N copies of cmd (default one per CPU) and splits stdin between
+   them in blocks of whole lines.  Without -k the copies live for the
+   whole stream, each block goes to whichever copy is ready for it and
+   their output is merged a line at a time in whatever order it comes.
+   With -k every block gets its own copy of cmd and the outputs are
+   written in input order, so cmd needn't be line for line (gzip works,
+   the members concatenate).  Runs as a pipeline stage in the forked
+   child, so the shell itself never blocks on the stream.  */
+#define FANOUT_BLOCK 65536          //default block without -k
+#define FANOUT_ORDERED_BLOCK (1 << 20)  //each block costs a fork with -k
+
+typedef struct fan_worker{
+    pid_t pid;          //0 when the slot is free
+    int in;             //feeds the copy, -1 once closed
+    int out;            //its output, -1 at EOF
+    char *block;        //block being written to in, NULL if idle
+    size_t block_len;
+    size_t block_off;
+    char *obuf;         //output held back (partial line, or not its turn)
+    size_t olen;
+    size_t ocap;
+    long seq;           //-k: which block this copy is running
+} fan_worker;
+
+//blocking write of all of data, fanout's own stdout is a plain fd
+void fan_hold(fan_worker *w, const char *data, size_t n){
+    if(w->olen + n > w->ocap){
+        w->ocap = (w->olen + n) * 2;
+        w->obuf = (char *)realloc(w->obuf, w->ocap);
+    }
+    memcpy(w->obuf + w->olen, data, n);
+    w->olen += n;
+}
+
+pid_t fan_spawn(fan_worker *w, char **argv, char **envp){
+    int to[2], from[2];
+    if(pipe2(to, O_CLOEXEC) < 0 || pipe2(from, O_CLOEXEC) < 0){
+        perror("fanout: pipe");
+        return -1;
+    }
+    pid_t pid = fork();
+    if(pid == 0){
+        dup2(to[0], STDIN_FILENO);
+        dup2(from[1], STDOUT_FILENO);
+        signal(SIGPIPE, SIG_DFL);
+        execvpe(argv[0], argv, envp);
+        fprintf(stderr, "fanout: %s: %s\n", argv[0], strerror(errno));
+        _exit(errno == ENOENT ? 127 : 126);
+    }
+    close(to[0]);
+    close(from[1]);
+    if(pid < 0){
+        perror("fanout: fork");
+        close(to[1]);
+        close(from[0]);
+        return -1;
+    }
+    fcntl(to[1], F_SETFL, O_NONBLOCK);
+    w->pid = pid;
+    w->in = to[1];
+    w->out = from[0];
+    w->block = NULL;
+    w->olen = 0;
+    return pid;
+}
+
+int fanout(char **argv, char **envp){
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int ordered = 0;
+    size_t block_size = 0;
+    int i = 1;
+
+    for(; argv[i] && argv[i][0] == '-'; i++){
+        if(strcmp(argv[i], "-k") == 0)
+            ordered = 1;
+        else if(strcmp(argv[i], "-n") == 0 && argv[i+1])
+            workers = atol(argv[++i]);
+        else if(strcmp(argv[i], "-b") == 0 && argv[i+1])
+            block_size = atol(argv[++i]);
+        else
+            break;
+    }
+    if(argv[i] == NULL || workers < 1){
+        fprintf(stderr, "fanout: usage: fanout [-n N] [-k] [-b BYTES] command [args...]\n");
+        return 2;
+    }
+    char **cmd = argv + i;
+    if(block_size == 0)
+        block_size = ordered ? FANOUT_ORDERED_BLOCK : FANOUT_BLOCK;
+
+    //the copies are our children now, not the shell's
+    signal(SIGCHLD, SIG_DFL);
+    //a copy that quits early mustn't take us down, write errors say so
+    signal(SIGPIPE, SIG_IGN);
+
+    fan_worker *w = (fan_worker *)calloc(workers, sizeof(fan_worker));
+    struct pollfd *fds = (struct pollfd *)malloc((2 * workers + 1) * sizeof(struct pollfd));
+    //input is read ahead into ibuf and cut into blocks at a newline
+    size_t icap = 2 * block_size;
+    char *ibuf = (char *)malloc(icap);
+    size_t ilen = 0;
+    int ieof = 0;
+    long next_seq = 0, next_emit = 0;
+    int status = 0;
+    int running = 0;
+    int broken = 0;     //our stdout went away
+
+    if(!ordered){
+        for(long k = 0; k < workers; k++){
+            if(fan_spawn(&w[k], cmd, envp) < 0)
+                return 1;
+            running++;
+        }
+    }
+
+    for(;;){
+        //hand out blocks to idle copies, starting new ones with -k
+        for(long k = 0; k < workers; k++){
+            if(ordered ? w[k].pid != 0 : (w[k].block != NULL || w[k].in < 0))
+                continue;
+            size_t cut = 0;
+            if(ieof){
+                cut = ilen;
+            }
+            else if(ilen >= block_size){
+                cut = ilen;
+                while(cut > 0 && ibuf[cut-1] != '\n')
+                    cut--;
+                //one line longer than the buffer, read on to its end
+                if(cut == 0 && ilen == icap){
+                    icap *= 2;
+                    ibuf = (char *)realloc(ibuf, icap);
+                }
+            }
+            if(cut == 0)
+                break;
+            if(ordered){
+                if(fan_spawn(&w[k], cmd, envp) < 0)
+                    return 1;
+                w[k].seq = next_seq++;
+                running++;
+            }
+            w[k].block = (char *)malloc(cut);
+            memcpy(w[k].block, ibuf, cut);
+            w[k].block_len = cut;
+            w[k].block_off = 0;
+            memmove(ibuf, ibuf + cut, ilen - cut);
+            ilen -= cut;
+        }
+        //nothing more coming, let the idle copies finish
+        for(long k = 0; k < workers; k++){
+            if(w[k].pid && w[k].in >= 0 && w[k].block == NULL && (ordered || (ieof && ilen == 0))){
+                close(w[k].in);
+                w[k].in = -1;
+            }
+        }
+        //without -k there's nobody left to take more input
+        if(running == 0 && (!ordered || (ieof && ilen == 0)))
+            break;
+        if(broken){
+            for(long k = 0; k < workers; k++){
+                if(w[k].pid && w[k].out >= 0){
+                    kill(w[k].pid, SIGTERM);
+                    waitpid(w[k].pid, NULL, 0);
+                }
+            }
+            return 128 + SIGPIPE;
+        }
+
+        int nfds = 0;
+        int input_slot = -1;
+        if(!ieof && ilen < icap){
+            input_slot = nfds;
+            fds[nfds].fd = STDIN_FILENO;
+            fds[nfds++].events = POLLIN;
+        }
+        for(long k = 0; k < workers; k++){
+            if(w[k].pid == 0)
+                continue;
+            if(w[k].block){
+                fds[nfds].fd = w[k].in;
+                fds[nfds++].events = POLLOUT;
+            }
+            if(w[k].out >= 0){
+                fds[nfds].fd = w[k].out;
+                fds[nfds++].events = POLLIN;
+            }
+        }
+        if(poll(fds, nfds, -1) < 0){
+            if(errno == EINTR)
+                continue;
+            perror("fanout: poll");
+            return 1;
+        }
+
+        if(input_slot >= 0 && fds[input_slot].revents){
+            ssize_t n = read(STDIN_FILENO, ibuf + ilen, icap - ilen);
+            if(n <= 0){
+                if(n == 0 || errno != EINTR)
+                    ieof = 1;
+            }
+            else{
+                ilen += n;
+            }
+        }
+
+        for(int f = 0; f < nfds; f++){
+            if(f == input_slot || fds[f].revents == 0)
+                continue;
+            long k;
+            for(k = 0; k < workers; k++){
+                if(w[k].pid && (w[k].in == fds[f].fd || w[k].out == fds[f].fd))
+                    break;
+            }
+            //closed earlier in this pass
+            if(k == workers)
+                continue;
+            fan_worker *wk = &w[k];
+
+            if(fds[f].fd == wk->in && wk->block){
+                ssize_t n = write(wk->in, wk->block + wk->block_off, wk->block_len - wk->block_off);
+                if(n < 0 && errno != EAGAIN && errno != EINTR){
+                    //the copy stopped reading, drop what's left
+                    n = wk->block_len - wk->block_off;
+                }
+                if(n > 0)
+                    wk->block_off += n;
+                if(wk->block_off == wk->block_len){
+                    free(wk->block);
+                    wk->block = NULL;
+                }
+                continue;
+            }
+
+            char chunk[65536];
+            ssize_t n = read(wk->out, chunk, sizeof(chunk));
+            if(n < 0 && (errno == EINTR || errno == EAGAIN))
+                continue;
+            if(n > 0){
+                if(ordered && wk->seq != next_emit){
+                    fan_hold(wk, chunk, n);
+                }
+                else if(ordered){
+                    broken |= write_all(STDOUT_FILENO, chunk, n) < 0;
+                }
+                else{
+                    //only whole lines, so two copies never split each other's
+                    fan_hold(wk, chunk, n);
+                    size_t keep = wk->olen;
+                    while(keep > 0 && wk->obuf[keep-1] != '\n')
+                        keep--;
+                    broken |= write_all(STDOUT_FILENO, wk->obuf, keep) < 0;
+                    memmove(wk->obuf, wk->obuf + keep, wk->olen - keep);
+                    wk->olen -= keep;
+                }
+                continue;
+            }
+
+            //EOF: the copy is done
+            close(wk->out);
+            wk->out = -1;
+            if(wk->in >= 0){
+                close(wk->in);
+                wk->in = -1;
+            }
+            free(wk->block);
+            wk->block = NULL;
+            int wstatus;
+            waitpid(wk->pid, &wstatus, 0);
+            if(status == 0){
+                if(WIFEXITED(wstatus))
+                    status = WEXITSTATUS(wstatus);
+                else if(WIFSIGNALED(wstatus))
+                    status = 128 + WTERMSIG(wstatus);
+            }
+            running--;
+            if(!ordered){
+                broken |= write_all(STDOUT_FILENO, wk->obuf, wk->olen) < 0;
+                wk->olen = 0;
+            }
+            //-k: the pid stays set until its output has been written
+        }
+
+        //-k: write finished blocks that are next in line, in order
+        while(ordered){
+            long k;
+            for(k = 0; k < workers; k++){
+                if(w[k].pid && w[k].seq == next_emit)
+                    break;
+            }
+            if(k == workers)
+                break;
+            if(w[k].olen){
+                broken |= write_all(STDOUT_FILENO, w[k].obuf, w[k].olen) < 0;
+                w[k].olen = 0;
+            }
+            if(w[k].out >= 0)
+                break;
+            w[k].pid = 0;
+            next_emit++;
+        }
+    }
+    return status;
+}
+
+/* cat, head, tail and wc without the exec.  They only take the common
+   options, anything else runs the real binary (see the accepts hooks in
+   stage_builtins).  They write with plain write(2) to fds 0-2, so they
+   work the same in a forked stage or in the shell itself.  */
+
+//open a file operand, - is stdin
+int open_operand(const char *cmd, const char *name){
+    if(strcmp(name, "-") == 0)
+        return STDIN_FILENO;
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        fprintf(stderr, "%s: %s: %s\n", cmd, name, strerror(errno));
+    return fd;
+}
+
+void close_operand(int fd){
+    if(fd != STDIN_FILENO)
+        close(fd);
+}
+
+/* Copy up to len bytes (-1 for all) from in to out, letting the kernel
+   move them: copy_file_range between files, sendfile from a file,
+   splice out of a pipe, and read/write only when none of those apply.  */
+int copy_fd(int in, int out, long long len){
+    struct stat in_st, out_st;
+    char buf[65536];
+    ssize_t n;
+    int mode = 0;       //0 copy_file_range, 1 sendfile, 2 splice, 3 read/write
+
+    if(fstat(in, &in_st) < 0 || fstat(out, &out_st) < 0)
+        mode = 3;
+    else if(S_ISREG(in_st.st_mode))
+        mode = S_ISREG(out_st.st_mode) ? 0 : 1;
+    else if(S_ISFIFO(in_st.st_mode))
+        mode = 2;
+    else
+        mode = 3;
+
+    while(len != 0){
+        size_t want = (len < 0 || len > (1 << 30)) ? (1 << 30) : (size_t)len;
+        if(mode == 0)
+            n = copy_file_range(in, NULL, out, NULL, want, 0);
+        else if(mode == 1)
+            n = sendfile(out, in, NULL, want);
+        else if(mode == 2)
+            n = splice(in, NULL, out, NULL, want, SPLICE_F_MOVE);
+        else{
+            n = read(in, buf, want < sizeof(buf) ? want : sizeof(buf));
+            if(n > 0 && write_all(out, buf, n) < 0)
+                return -1;
+        }
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            //the kernel can't do it for this pair of fds, copy it ourselves
+            if(mode < 3 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS
+                            || errno == EOPNOTSUPP || errno == EBADF)){
+                mode = mode == 0 ? 1 : 3;
+                continue;
+            }
+            return -1;
+        }
+        if(n == 0)
+            break;
+        if(len > 0)
+            len -= n;
+    }
+    return 0;
+}
+
+int cat_accepts(char **argv){
+    for(int i = 1; argv[i]; i++){
+        if(argv[i][0] == '-' && argv[i][1] != '\0' && strcmp(argv[i], "-u") != 0)
+            return 0;
+    }
+    return 1;
+}
+
+int cat_builtin(char **argv, char **envp){
+    int status = 0;
+    int files = 0;
+
+    for(int i = 1; argv[i] || files == 0; i++){
+        const char *name = argv[i] ? argv[i] : "-";
+        //-u is a no-op here, and not an operand: cat -u still reads stdin
+        if(strcmp(name, "-u") == 0)
+            continue;
+        files++;
+        int fd = open_operand("cat", name);
+        if(fd < 0){
+            status = 1;
+            continue;
+        }
+        if(copy_fd(fd, STDOUT_FILENO, -1) < 0){
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            status = 1;
+        }
+        close_operand(fd);
+        if(argv[i] == NULL)
+            break;
+    }
+    return status;
+}
+
+/* The options head and tail share: -n N, -N and -c N.  Returns the index
+   of the first file operand, or -1 for anything we leave to the real
+   command (tail -f, +N, head -n -N, size suffixes...).  */
+int parse_head_tail(char **argv, int *bytes, long long *count){
+    int i;
+    *bytes = 0;
+    *count = 10;
+    for(i = 1; argv[i] && argv[i][0] == '-' && argv[i][1]; i++){
+        char *a = argv[i];
+        char *value;
+        if(strcmp(a, "--") == 0)
+            return i + 1;
+        if((a[1] == 'n' || a[1] == 'c') && (a[2] || argv[i+1])){
+            *bytes = a[1] == 'c';
+            value = a[2] ? a + 2 : argv[++i];
+        }
+        else if(a[1] >= '0' && a[1] <= '9'){
+            value = a + 1;
+        }
+        else{
+            return -1;
+        }
+        char *end;
+        *count = strtoll(value, &end, 10);
+        if(*value < '0' || *value > '9' || *end != '\0')
+            return -1;
+    }
+    return i;
+}
+
+int head_tail_accepts(char **argv){
+    int bytes;
+    long long count;
+    return parse_head_tail(argv, &bytes, &count) >= 0;
+}
+
+//what GNU head and tail print between several files
+void file_header(char **files, int i, int nfiles){
+    char header[4096];
+    if(nfiles < 2)
+        return;
+    int n = snprintf(header, sizeof(header), "%s==> %s <==\n", i ? "\n" : "",
+                     strcmp(files[i], "-") == 0 ? "standard input" : files[i]);
+    write_all(STDOUT_FILENO, header, n < (int)sizeof(header) ? n : (int)sizeof(header) - 1);
+}
+
+//the first count lines or bytes of fd
+int head_fd(int fd, int bytes, long long count){
+    char buf[65536];
+    if(bytes)
+        return copy_fd(fd, STDOUT_FILENO, count);
+    while(count > 0){
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return n;
+        ssize_t keep = 0;
+        while(keep < n && count > 0){
+            char *nl = memchr(buf + keep, '\n', n - keep);
+            if(nl == NULL){
+                keep = n;
+                break;
+            }
+            keep = nl - buf + 1;
+            count--;
+        }
+        if(write_all(STDOUT_FILENO, buf, keep) < 0)
+            return -1;
+        //like GNU head, leave a seekable input just past what we printed
+        if(keep < n)
+            lseek(fd, keep - n, SEEK_CUR);
+    }
+    return 0;
+}
+
+int head_builtin(char **argv, char **envp){
+    int bytes;
+    long long count;
+    int first = parse_head_tail(argv, &bytes, &count);
+    char *stdin_only[] = { "-", NULL };
+    char **files = argv[first] ? argv + first : stdin_only;
+    int nfiles = 0, status = 0;
+
+    while(files[nfiles])
+        nfiles++;
+    for(int i = 0; i < nfiles; i++){
+        int fd = open_operand("head", files[i]);
+        if(fd < 0){
+            status = 1;
+            continue;
+        }
+        file_header(files, i, nfiles);
+        if(head_fd(fd, bytes, count) < 0){
+            fprintf(stderr, "head: %s: %s\n", files[i], strerror(errno));
+            status = 1;
+        }
+        close_operand(fd);
+    }
+    return status;
+}
+
+//where the last count lines or bytes of data start
+size_t tail_start(const char *data, size_t len, int bytes, long long count){
+    if(bytes)
+        return len > (size_t)count ? len - count : 0;
+    if(count == 0)
+        return len;
+    //a final newline ends the last line, it doesn't start a new one
+    size_t k = (len > 0 && data[len-1] == '\n') ? len - 1 : len;
+    long long seen = 0;
+    while(k > 0){
+        const char *nl = memrchr(data, '\n', k);
+        if(nl == NULL)
+            break;
+        k = nl - data;
+        if(++seen == count)
+            return k + 1;
+    }
+    return 0;
+}
+
+/* The last count lines or bytes of fd.  A regular file is read backwards
+   from the end a block at a time until enough newlines turn up, then
+   the rest is sent from there; only a pipe is read through.  */
+int tail_fd(int fd, int bytes, long long count){
+    struct stat st;
+    char buf[65536];
+
+    //proc and sysfs files say size 0, those have to be read through
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+        off_t end = st.st_size;
+        off_t start = bytes ? (end > count ? end - count : 0) : 0;
+        off_t pos = end;
+        char last;
+
+        if(!bytes && count == 0)
+            start = end;
+        else if(!bytes){
+            if(end > 0 && pread(fd, &last, 1, end - 1) == 1 && last == '\n')
+                pos = end - 1;
+            long long seen = 0;
+            while(pos > 0 && seen < count){
+                size_t want = pos > (off_t)sizeof(buf) ? sizeof(buf) : (size_t)pos;
+                if(pread(fd, buf, want, pos - want) != (ssize_t)want)
+                    return -1;
+                pos -= want;
+                size_t k = want;
+                char *nl;
+                while(seen < count && (nl = memrchr(buf, '\n', k)) != NULL){
+                    k = nl - buf;
+                    if(++seen == count)
+                        start = pos + k + 1;
+                }
+            }
+        }
+        lseek(fd, start, SEEK_SET);
+        return copy_fd(fd, STDOUT_FILENO, end - start);
+    }
+
+    //a pipe: keep reading, dropping what can no longer be in the answer
+    size_t cap = 1 << 16, len = 0;
+    char *data = (char *)malloc(cap);
+    ssize_t n;
+    while(1){
+        if(len == cap){
+            size_t from = tail_start(data, len, bytes, count);
+            if(from > len / 2){
+                memmove(data, data + from, len - from);
+                len -= from;
+            }
+            else{
+                cap *= 2;
+                data = (char *)realloc(data, cap);
+            }
+        }
+        n = read(fd, data + len, cap - len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        len += n;
+    }
+    size_t from = tail_start(data, len, bytes, count);
+    int r = write_all(STDOUT_FILENO, data + from, len - from);
+    free(data);
+    return n < 0 ? -1 : r;
+}
+
+int tail_builtin(char **argv, char **envp){
+    int bytes;
+    long long count;
+    int first = parse_head_tail(argv, &bytes, &count);
+    char *stdin_only[] = { "-", NULL };
+    char **files = argv[first] ? argv + first : stdin_only;
+    int nfiles = 0, status = 0;
+
+    while(files[nfiles])
+        nfiles++;
+    for(int i = 0; i < nfiles; i++){
+        int fd = open_operand("tail", files[i]);
+        if(fd < 0){
+            status = 1;
+            continue;
+        }
+        file_header(files, i, nfiles);
+        if(tail_fd(fd, bytes, count) < 0){
+            fprintf(stderr, "tail: %s: %s\n", files[i], strerror(errno));
+            status = 1;
+        }
+        close_operand(fd);
+    }
+    return status;
+}
+
+//newlines in data, 64 bytes a step with SSE2 where we have it
+long long count_newlines(const char *data, size_t len){
+    long long lines = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    for(; i + 64 <= len; i += 64){
+        unsigned int m0 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), nl));
+        unsigned int m1 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 16)), nl));
+        unsigned int m2 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 32)), nl));
+        unsigned int m3 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 48)), nl));
+        unsigned long long mask = m0 | (m1 << 16) | ((unsigned long long)m2 << 32) | ((unsigned long long)m3 << 48);
+        lines += __builtin_popcountll(mask);
+    }
+#endif
+    for(; i < len; i++)
+        lines += data[i] == '\n';
+    return lines;
+}
+
+//wc takes -l and -c, the rest (words, chars) depend on the locale
+int wc_accepts(char **argv){
+    for(int i = 1; argv[i] && argv[i][0] == '-' && argv[i][1]; i++){
+        if(strcmp(argv[i], "--") == 0)
+            break;
+        if(strspn(argv[i] + 1, "lc") != strlen(argv[i] + 1))
+            return 0;
+    }
+    //plain wc means lines, words and bytes
+    return argv[1] != NULL && argv[1][0] == '-' && argv[1][1] && strcmp(argv[1], "--") != 0;
+}
+
+//lines and bytes of fd, mapping a regular file instead of reading it
+int wc_fd(int fd, int want_lines, long long *lines, long long *bytes){
+    struct stat st;
+    char buf[65536];
+    ssize_t n;
+
+    *lines = 0;
+    *bytes = 0;
+    //proc and sysfs files say size 0, those have to be read through
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+        off_t pos = lseek(fd, 0, SEEK_CUR);
+        if(pos < 0)
+            pos = 0;
+        *bytes = st.st_size > pos ? st.st_size - pos : 0;
+        if(!want_lines || *bytes == 0)
+            return 0;
+        //mmap needs a page aligned offset
+        off_t base = pos & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+        size_t maplen = st.st_size - base;
+        char *map = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, fd, base);
+        if(map != MAP_FAILED){
+            madvise(map, maplen, MADV_SEQUENTIAL);
+            *lines = count_newlines(map + (pos - base), *bytes);
+            munmap(map, maplen);
+            return 0;
+        }
+        *bytes = 0;
+    }
+    while((n = read(fd, buf, sizeof(buf))) != 0){
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        *bytes += n;
+        if(want_lines)
+            *lines += count_newlines(buf, n);
+    }
+    return 0;
+}
+
+int wc_builtin(char **argv, char **envp){
+    int want_lines = 0, want_bytes = 0;
+    int i;
+    for(i = 1; argv[i] && argv[i][0] == '-' && argv[i][1]; i++){
+        if(strcmp(argv[i], "--") == 0){
+            i++;
+            break;
+        }
+        want_lines |= strchr(argv[i], 'l') != NULL;
+        want_bytes |= strchr(argv[i], 'c') != NULL;
+    }
+    char *stdin_only[] = { "-", NULL };
+    int named = argv[i] != NULL;
+    char **files = named ? argv + i : stdin_only;
+    int nfiles = 0, status = 0;
+    while(files[nfiles])
+        nfiles++;
+
+    //GNU pads every count to the width of the total size of the files
+    int width = 1;
+    if(nfiles > 1 || want_lines + want_bytes > 1){
+        long long total_size = 0;
+        int min_width = 1;
+        struct stat st;
+        for(int f = 0; f < nfiles; f++){
+            if(strcmp(files[f], "-") != 0 && stat(files[f], &st) == 0 && S_ISREG(st.st_mode))
+                total_size += st.st_size;
+            else if(strcmp(files[f], "-") == 0 && fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode))
+                total_size += st.st_size;
+            else
+                min_width = 7;
+        }
+        for(; total_size >= 10; total_size /= 10)
+            width++;
+        if(width < min_width)
+            width = min_width;
+    }
+
+    long long total_lines = 0, total_bytes = 0;
+    char line[4200];
+    for(int f = 0; f <= nfiles; f++){
+        long long lines, bytes;
+        const char *label;
+        if(f == nfiles){
+            if(nfiles < 2)
+                break;
+            lines = total_lines;
+            bytes = total_bytes;
+            label = "total";
+        }
+        else{
+            int fd = open_operand("wc", files[f]);
+            if(fd < 0){
+                status = 1;
+                continue;
+            }
+            if(wc_fd(fd, want_lines, &lines, &bytes) < 0){
+                fprintf(stderr, "wc: %s: %s\n", files[f], strerror(errno));
+                status = 1;
+            }
+            close_operand(fd);
+            total_lines += lines;
+            total_bytes += bytes;
+            label = named ? files[f] : NULL;
+        }
+        int n = 0;
+        if(want_lines)
+            n += snprintf(line + n, sizeof(line) - n, "%*lld", width, lines);
+        if(want_bytes)
+            n += snprintf(line + n, sizeof(line) - n, "%s%*lld", n ? " " : "", width, bytes);
+        if(label)
+            n += snprintf(line + n, sizeof(line) - n, " %.4096s", label);
+        line[n++] = '\n';
+        write_all(STDOUT_FILENO, line, n);
+    }
+    return status;
+}
+
+//commands that run inside the forked stage instead of being exec'd
+typedef struct stage_builtin{
+    const char *name;
+    int (*run)(char **argv, char **envp);
+    int (*accepts)(char **argv);    //NULL takes any options, else 0 means exec the real one
+    char in_shell;                  //cheap and safe to run in the shell itself, no fork
+} stage_builtin;
+
+int batch_stage(char **argv, char **envp);
+
+stage_builtin stage_builtins[] = {
+    {"fanout", fanout, NULL, 0},
+    {"cat", cat_builtin, cat_accepts, 1},
+    {"head", head_builtin, head_tail_accepts, 1},
+    {"tail", tail_builtin, head_tail_accepts, 1},
+    {"wc", wc_builtin, wc_accepts, 1},
+    {"batch", batch_stage, NULL, 0},
+    {NULL, NULL, NULL, 0}
+};
+
+const stage_builtin *find_stage_builtin(char **argv){
+    for(int i = 0; stage_builtins[i].name; i++){
+        if(strcmp(stage_builtins[i].name, argv[0]) == 0){
+            if(stage_builtins[i].accepts && !stage_builtins[i].accepts(argv))
+                return NULL;
+            return &stage_builtins[i];
+        }
+    }
+    return NULL;
+}
+
+/* Layer a command's VAR=x overrides onto the envp snapshot.  Only
+   called in the child after fork, so the writes land in our private
+   copy-on-write pages and the shell's snapshot stays as it was.  */
+void layer_assigns (char **envp, char **assigns)
+{
+  int n = env_count;
+
+  for (; assigns && *assigns; assigns++)
+    {
+      size_t name_len = strchr (*assigns, '=') - *assigns + 1;
+      int i;
+
+      for (i = 0; i < n; i++)
+        if (strncmp (envp[i], *assigns, name_len) == 0)
+          break;
+      if (i == n)
+        {
+          if (n == env_count + ENV_SPARE)
+            {
+              fprintf (stderr, "wsh: too many environment overrides\n");
+              exit (1);
+            }
+          n++;
+        }
+      envp[i] = *assigns;
+    }
+  envp[n] = NULL;
+}
+
+/* Exec p in the child, searching the PATH handles in order if the
+   lookup cache didn't have it.  Every failed attempt is written to
+   errfd, if there is one; the pipe is close-on-exec, so the shell reads
+   EOF right after a successful exec.  Without a pipe *tried, if given,
+   tells a parent sharing our memory which dir we were at.  Only returns
+   the errno of the final failure.  */
+int exec_process (process *p, char **envp, int errfd, int *tried)
+{
+  exec_report r;
+  int err = ENOENT;
+
+  if (p->exec_path)
+    {
+      execve (p->exec_path, p->argv, envp);
+      return errno;
+    }
+  if (p->exec_name)
+    {
+      execveat (p->exec_dirfd, p->exec_name, p->argv, envp, 0);
+      return errno;
+    }
+
+  for (int i = 0; i < path_dir_count; i++)
+    {
+      char rel[4096];
+      const char *target = p->argv[0];
+
+      if (path_dirs[i].fd == AT_FDCWD)
+        {
+          snprintf (rel, sizeof (rel), "%s/%s", path_dirs[i].name, p->argv[0]);
+          target = rel;
+        }
+      if (tried)
+        *tried = i;
+      execveat (path_dirs[i].fd, target, p->argv, envp, 0);
+      /* ENOENT for a file that is there means a #! script, which needs
+         a path its interpreter can open.  */
+      if (errno == ENOENT && path_dirs[i].fd != AT_FDCWD
+          && faccessat (path_dirs[i].fd, target, F_OK, 0) == 0)
+        {
+          snprintf (rel, sizeof (rel), "%s/%s", path_dirs[i].name, p->argv[0]);
+          execve (rel, p->argv, envp);
+        }
+
+      r.dir = i;
+      r.err = errno;
+      if (errfd >= 0)
+        write (errfd, &r, sizeof (r));
+      /* Like execvp, a permission problem beats "not found".  */
+      if (r.err != ENOENT && r.err != ENOTDIR && err != EACCES)
+        err = r.err;
+    }
+  return err;
+}
+
+/* Apply p's redirections, left to right.  Returns -1 after saying why
+   if one fails.  */
+int apply_redirects (process *p)
+{
+  for (int i = 0; i < p->nredirs; i++)
+    {
+      redirect *r = &p->redirs[i];
+      int fd;
+
+      switch (r->op)
+        {
+        case REDIR_DUP:
+          if (dup2 (r->src, r->fd) < 0)
+            {
+              fprintf (stderr, "wsh: %d: %s\n", r->src, strerror (errno));
+              return -1;
+            }
+          break;
+        case REDIR_CLOSE:
+          close (r->fd);
+          break;
+        default:
+          fd = open (r->path,
+                     r->op == REDIR_IN ? O_RDONLY
+                     : r->op == REDIR_APPEND ? O_WRONLY | O_CREAT | O_APPEND
+                     : O_WRONLY | O_CREAT | O_TRUNC, 0666);
+          if (fd < 0)
+            {
+              fprintf (stderr, "wsh: %s: %s\n", r->path, strerror (errno));
+              return -1;
+            }
+          if (fd != r->fd)
+            {
+              dup2 (fd, r->fd);
+              close (fd);
+            }
+        }
+    }
+  return 0;
+}
+
+/* Do what exec does to close-on-exec fds, for a child that won't exec.  */
+void close_cloexec_fds (void)
+{
+  DIR *dir = opendir ("/proc/self/fd");
+  struct dirent *d;
+  int skip;
+
+  if (dir == NULL)
+    {
+      for (int fd = 3; fd < 1024; fd++)
+        if (fcntl (fd, F_GETFD) & FD_CLOEXEC)
+          close (fd);
+      return;
+    }
+  skip = dirfd (dir);
+  while ((d = readdir (dir)) != NULL)
+    {
+      int fd = atoi (d->d_name);
+      if (fd > 2 && fd != skip && (fcntl (fd, F_GETFD) & FD_CLOEXEC))
+        close (fd);
+    }
+  closedir (dir);
+}
+
+//split line on blanks in place, at most max words, NULL terminated
+int split_words(char *line, char **words, int max){
+    int n = 0;
+    char *save;
+    for(char *w = strtok_r(line, " \t", &save); w && n < max; w = strtok_r(NULL, " \t", &save))
+        words[n++] = w;
+    words[n] = NULL;
+    return n;
+}
+
+/* Expand a line's words into command and args: $VAR, $1 and the like,
+   then globs.  A lone $@ or $* becomes one word per parameter.  */
+void expand_tokens(char **tokens, char *command, char *args[]){
+    int arg_index = 0;
+    char *word;
+
+    //blank line, nothing to run
+    if(tokens[0] == NULL){
+        command[0] = '\0';
+        args[0] = NULL;
+        return;
+    }
+    word = expand_word(tokens[0]);
+    snprintf(command, 256, "%s", word);
+    free(word);
+
+    int t;
+    int stage_at = -1;      //where the current pipeline stage's words start, -1 for command
+    for(t = 1; tokens[t] != NULL && arg_index < MAX_ARGS - 1; t++){
+        if(strcmp(tokens[t], "$@") == 0 || strcmp(tokens[t], "$*") == 0){
+            for(int k = 1; k < positional_count && arg_index < MAX_ARGS - 1; k++)
+                args[arg_index++] = strdup(positional[k]);
+            continue;
+        }
+        word = expand_word(tokens[t]);
+        //batch -g does its own matching, without the MAX_ARGS cap
+        int own_glob = arg_index > stage_at + 1 && strcmp(args[arg_index-1], "-g") == 0
+                       && strcmp(stage_at < 0 ? command : args[stage_at], "batch") == 0;
+        //a pattern that matches nothing is passed on as it is
+        if(!own_glob && is_glob_word(word) && glob_expand(word, args, &arg_index, MAX_ARGS - 1) > 0){
+            free(word);
+            continue;
+        }
+        args[arg_index++] = word;
+        if(strcmp(word, "|") == 0)
+            stage_at = arg_index;
+    }
+    if(tokens[t] != NULL)
+        fprintf(stderr, "wsh: too many arguments, only the first %d used\n", MAX_ARGS - 1);
+    args[arg_index] = NULL;
+}
+
+function *find_function(const char *name){
+    for(function *f = func_table[name_hash(name, strlen(name)) % FUNC_BUCKETS]; f; f = f->next){
+        if(strcmp(f->name, name) == 0)
+            return f;
+    }
+    return NULL;
+}
+
+void free_function(function *f){
+    for(int i = 0; i < f->nlines; i++){
+        for(char **w = f->lines[i]; *w; w++)
+            free(*w);
+        free(f->lines[i]);
+    }
+    free(f->lines);
+    free(f->name);
+    free(f);
+}
+
+void unset_function(const char *name){
+    function **link = &func_table[name_hash(name, strlen(name)) % FUNC_BUCKETS];
+    for(; *link; link = &(*link)->next){
+        if(strcmp((*link)->name, name) == 0){
+            function *gone = *link;
+            *link = gone->next;
+            free_function(gone);
+            return;
+        }
+    }
+}
+
+//split a body line once, now, so calls never parse it again
+void add_function_line(function *f, const char *line){
+    char *copy = strdup(line);
+    char *words[MAX_ARGS + 2];
+    int n = split_words(copy, words, MAX_ARGS + 1);
+    if(n > 0){
+        char **saved = (char **)malloc((n + 1) * sizeof(char *));
+        for(int i = 0; i <= n; i++)
+            saved[i] = words[i] ? strdup(words[i]) : NULL;
+        f->lines = (char ***)realloc(f->lines, (f->nlines + 1) * sizeof(char **));
+        f->lines[f->nlines++] = saved;
+    }
+    free(copy);
+}
+
+/* If the line in buffer starts a function, NAME() { or NAME () {, read
+   its body from in up to a line holding just } and store it.  A body on
+   the same line, NAME() { cmd args }, works too.  Returns 1 if the line
+   was a definition.  */
+int read_function(line_reader *in, int prompt){
+    char *c = buffer;
+    char name[256];
+    size_t len = 0;
+
+    buffer[strcspn(buffer, "\n")] = '\0';
+    while(*c == ' ' || *c == '\t')
+        c++;
+    if(!(*c == '_' || (*c >= 'A' && *c <= 'Z') || (*c >= 'a' && *c <= 'z')))
+        return 0;
+    while(len < sizeof(name) - 1 && (c[len] == '_' || c[len] == '-' || (c[len] >= 'A' && c[len] <= 'Z')
+          || (c[len] >= 'a' && c[len] <= 'z') || (c[len] >= '0' && c[len] <= '9')))
+        len++;
+    memcpy(name, c, len);
+    name[len] = '\0';
+    c += len;
+    while(*c == ' ' || *c == '\t')
+        c++;
+    if(c[0] != '(' || c[1] != ')')
+        return 0;
+    c += 2;
+    while(*c == ' ' || *c == '\t')
+        c++;
+    if(*c != '{')
+        return 0;
+    c++;
+
+    function *f = (function *)calloc(1, sizeof(function));
+    f->name = strdup(name);
+
+    //whatever follows the { on the header line is body too
+    char *rest = strdup(c);
+    size_t rest_len = strlen(rest);
+    while(rest_len > 0 && (rest[rest_len-1] == ' ' || rest[rest_len-1] == '\t'))
+        rest[--rest_len] = '\0';
+    int closed = rest_len > 0 && rest[rest_len-1] == '}';
+    if(closed)
+        rest[--rest_len] = '\0';
+    add_function_line(f, rest);
+    free(rest);
+
+    while(!closed){
+        if(prompt){
+            printf("> ");
+            fflush(stdout);
+        }
+        if(read_line(in) < 0){
+            fprintf(stderr, "wsh: %s: unexpected end of input in function\n", name);
+            free_function(f);
+            return 1;
+        }
+        buffer[strcspn(buffer, "\n")] = '\0';
+        char *line = buffer;
+        while(*line == ' ' || *line == '\t')
+            line++;
+        if(strcmp(line, "}") == 0)
+            break;
+        add_function_line(f, line);
+    }
+
+    unset_function(name);
+    unsigned int h = name_hash(name, strlen(name)) % FUNC_BUCKETS;
+    f->next = func_table[h];
+    func_table[h] = f;
+    return 1;
+}
+
+/* Turn a forked child into a shell of its own: the parent's jobs, watches
+   and the close-on-exec fds behind them aren't ours, and SIGCHLD needs
+   its own self-pipe.  Used to run functions as pipeline stages or in
+   the background.  */
+void become_subshell(void){
+  struct sigaction sa;
+
+  /* The PATH handles go with the other close-on-exec fds; forget them
+     without closing, the numbers may be reused already.  */
+  close_cloexec_fds ();
+  path_dirs = NULL;
+  path_dir_count = 0;
+  path_dirty = 1;
+  disk_cache = NULL;
+  status_map = NULL;
+  status_on = 0;
+  journal_off = 1;
+  helper_threads = 0;           /* fork copied none of them */
+  next_timeout_ns = 0;
+  next_limits = NULL;
+  next_nlimits = 0;
+  /* Jobs started in here stay in the cgroup we were started in.  */
+  cgroup_on = 0;
+  cgroup_root = -1;
+  next_cgroup = 0;
+
+  /* The glob listings and captured output rings aren't mapped in here
+     (MADV_DONTFORK), drop the pointers to them.  */
+  memset (glob_cache, 0, sizeof (glob_cache));
+  glob_cache_count = 0;
+  glob_retired = NULL;
+
+  watch_count = 0;
+  first_job = NULL;
+  current_job = NULL;
+  first_client = NULL;
+  shell_is_interactive = 0;
+  job_stdin = STDIN_FILENO;
+  job_stdout = STDOUT_FILENO;
+  job_stderr = STDERR_FILENO;
+  run_in_background = 0;
+
+  if (pipe2 (sigchld_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+    {
+      perror ("pipe");
+      _exit (1);
+    }
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = sig_child_handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset (&sa.sa_mask);
+  sigaction (SIGCHLD, &sa, NULL);
+  add_watch (sigchld_pipe[0], reap_children, NULL);
+}
+
+//function bodies run through these two, which come much later
+int handle_prompt(char* command, char* args[]);
+int only_assignments(char *command, char *args[]);
+void run_group(function *g, char *tail);
+
+/* A ( ) group in a function body, starting at line i.  Returns the
+   index of its last line.  */
+int call_group(function *f, int i){
+    char text[65536];
+    char tail[4096] = "";
+    function *g = (function *)calloc(1, sizeof(function));
+
+    g->name = strdup("(");
+    text[0] = '\0';
+    for(char **w = f->lines[i]; *w; w++){
+        strncat(text, *w, sizeof(text) - strlen(text) - 2);
+        strcat(text, " ");
+    }
+    char *close = strrchr(text, ')');
+    if(close){
+        *close = '\0';
+        snprintf(tail, sizeof(tail), "%s", close + 1);
+        add_function_line(g, text + 1);
+    }
+    else{
+        add_function_line(g, text + 1);
+        for(i++; i < f->nlines && f->lines[i][0][0] != ')'; i++){
+            text[0] = '\0';
+            for(char **w = f->lines[i]; *w; w++){
+                strncat(text, *w, sizeof(text) - strlen(text) - 2);
+                strcat(text, " ");
+            }
+            add_function_line(g, text);
+        }
+        if(i < f->nlines){
+            tail[0] = '\0';
+            strncat(tail, f->lines[i][0] + 1, sizeof(tail) - 2);
+            for(char **w = f->lines[i] + 1; *w; w++){
+                strncat(tail, " ", sizeof(tail) - strlen(tail) - 1);
+                strncat(tail, *w, sizeof(tail) - strlen(tail) - 1);
+            }
+        }
+    }
+    run_group(g, tail);
+    return i;
+}
+
+/* Run f with argv as its $0, $1...  in this process.  Returns the status
+   of the last command, or what return gave.  exit leaves the shell.  */
+int call_function(function *f, char **argv){
+    char command[256];
+    char *args[MAX_ARGS];
+    char **saved = positional;
+    int saved_count = positional_count;
+
+    if(func_depth >= FUNC_DEPTH_MAX){
+        fprintf(stderr, "wsh: %s: too many nested calls\n", f->name);
+        return 1;
+    }
+    positional = argv;
+    for(positional_count = 0; argv[positional_count]; positional_count++)
+        ;
+    //the caller's line may be the last, but the body's lines aren't
+    int saved_last = last_line;
+    last_line = 0;
+    func_depth++;
+    last_status = 0;
+    for(int i = 0; i < f->nlines && !func_returning; i++){
+        if(f->lines[i][0][0] == '('){
+            i = call_group(f, i);
+            continue;
+        }
+        expand_tokens(f->lines[i], command, args);
+        int done = handle_prompt(command, args);
+        for(int k = 0; args[k] != NULL; k++)
+            free(args[k]);
+        //exit in a function leaves the shell right away
+        if(done)
+            exit(last_status);
+    }
+    func_depth--;
+    func_returning = 0;
+    last_line = saved_last;
+    positional = saved;
+    positional_count = saved_count;
+    return last_status;
+}
+
+/* Resource limits.  ulimit sets the shell's own, which every child
+   inherits.  ulimit OPTS cmd... gives just that job limits, set in each
+   of its children before the exec, and ulimit -j N OPTS changes them on
+   a running job with prlimit.  */
+typedef struct rlimit_option{
+    char letter;
+    int resource;
+    int scale;                  //bytes in the unit the user gives
+    const char *name;
+    const char *unit;
+} rlimit_option;
+
+rlimit_option rlimit_options[] = {
+    {'c', RLIMIT_CORE, 512, "core file size", "blocks"},
+    {'d', RLIMIT_DATA, 1024, "data seg size", "kbytes"},
+    {'f', RLIMIT_FSIZE, 512, "file size", "blocks"},
+    {'l', RLIMIT_MEMLOCK, 1024, "max locked memory", "kbytes"},
+    {'m', RLIMIT_RSS, 1024, "max memory size", "kbytes"},
+    {'n', RLIMIT_NOFILE, 1, "open files", ""},
+    {'s', RLIMIT_STACK, 1024, "stack size", "kbytes"},
+    {'t', RLIMIT_CPU, 1, "cpu time", "seconds"},
+    {'u', RLIMIT_NPROC, 1, "max user processes", ""},
+    {'v', RLIMIT_AS, 1024, "virtual memory", "kbytes"},
+    {0, 0, 0, NULL, NULL}
+};
+
+typedef struct job_limit{
+    const rlimit_option *option;
+    char which;                 //'S' or 'H' for just that one, 0 for both
+    rlim_t value;               //in bytes or seconds, not the user's units
+} job_limit;
+
+//l applied to the limit in r
+void change_limit(const job_limit *l, struct rlimit *r){
+    if(l->which != 'H')
+        r->rlim_cur = l->value;
+    if(l->which != 'S')
+        r->rlim_max = l->value;
+}
+
+/* Set n limits on the calling process.  Returns 0, or the errno of the
+   first one refused.  Safe in a vfork child.  */
+int apply_limits(const job_limit *limits, int n){
+    struct rlimit r;
+    for(int i = 0; i < n; i++){
+        if(getrlimit(limits[i].option->resource, &r) < 0)
+            return errno;
+        change_limit(&limits[i], &r);
+        if(setrlimit(limits[i].option->resource, &r) < 0)
+            return errno;
+    }
+    return 0;
+}
+
+void launch_process (process *p, pid_t pgid,
+                int infile, int outfile, int errfile,
+                int curr_bg, char **envp, int errfd)
+{
+  exec_report r;
+  pid_t pid;
+
+  /* A job with a deadline gets a group of its own to signal even in a
+     script, where everything else shares the shell's.  */
+  if (!shell_is_interactive && spawn_own_group)
+    setpgid (0, pgid);
+
+  if (shell_is_interactive)
     {
       /* Put the process into the process group and give the process group
          the terminal, if appropriate.
@@ -314,471 +4055,3682 @@ void launch_process (process *p, pid_t pgid,
       if (!curr_bg)
         tcsetpgrp (shell_terminal, pgid);
 
-      /* Set the handling for job control signals back to the default.  */
-      signal (SIGINT, SIG_DFL);
-      signal (SIGQUIT, SIG_DFL);
-      signal (SIGTSTP, SIG_DFL);
-      signal (SIGTTIN, SIG_DFL);
-      signal (SIGTTOU, SIG_DFL);
-      signal (SIGCHLD, SIG_DFL);
+      /* Set the handling for job control signals back to the default.  */
+      signal (SIGINT, SIG_DFL);
+      signal (SIGQUIT, SIG_DFL);
+      signal (SIGTSTP, SIG_DFL);
+      signal (SIGTTIN, SIG_DFL);
+      signal (SIGTTOU, SIG_DFL);
+      signal (SIGCHLD, SIG_DFL);
+    }
+
+  /* Set the standard input/output channels of the new process.  */
+  if (infile != STDIN_FILENO)
+    dup2 (infile, STDIN_FILENO);
+  if (outfile != STDOUT_FILENO)
+    dup2 (outfile, STDOUT_FILENO);
+  if (errfile != STDERR_FILENO)
+    dup2 (errfile, STDERR_FILENO);
+  /* Close the originals only now, a captured job's stdout and stderr
+     are the same pipe.  */
+  if (infile > STDERR_FILENO)
+    close (infile);
+  if (outfile > STDERR_FILENO)
+    close (outfile);
+  if (errfile > STDERR_FILENO && errfile != outfile)
+    close (errfile);
+
+  /* Then the command's own redirections, left to right.  */
+  if (apply_redirects (p) < 0)
+    _exit (1);
+
+  if (p->assigns)
+    layer_assigns (envp, p->assigns);
+
+  /* Limits from ulimit ... cmd, the command doesn't run without them.  */
+  if (spawn_nlimits)
+    {
+      int err = apply_limits (spawn_limits, spawn_nlimits);
+      if (err)
+        {
+          fprintf (stderr, "wsh: ulimit: %s\n", strerror (err));
+          _exit (126);
+        }
+    }
+
+  /* With set -o perf, hold on until the shell has our counters on.  */
+  if (perf_go[0] >= 0)
+    {
+      char go;
+      close (perf_go[1]);
+      while (read (perf_go[0], &go, 1) < 0 && errno == EINTR)
+        ;
+      close (perf_go[0]);
+    }
+
+  /* So does a function, in a subshell made from this child.  */
+  if (p->function)
+    {
+      become_subshell ();
+      /* A group sees the $1... of whoever ran it.  */
+      _exit (call_function (p->function, p->group && positional ? positional : p->argv));
+    }
+
+  /* A stage builtin runs right here.  It gets what an exec would have
+     left it: closing errfd tells the shell it started, and closing the
+     other close-on-exec fds lets the rest of the pipeline see EOF.  */
+  if (p->stage_builtin)
+    {
+      close_cloexec_fds ();
+      _exit (p->stage_builtin->run (p->argv, envp));
+    }
+
+  /* Exec the new process.  Make sure we exit, and tell the shell why.  */
+  r.dir = -1;
+  r.err = exec_process (p, envp, errfd, NULL);
+  write (errfd, &r, sizeof (r));
+  _exit (r.err == ENOENT ? 127 : 126);
+}
+
+//drop every cached command lookup
+void clear_cmd_cache(void){
+    cmd_entry *e, *next;
+    for(int b = 0; b < CMD_BUCKETS; b++){
+        for(e = cmd_table[b]; e; e = next){
+            next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+        cmd_table[b] = NULL;
+    }
+}
+
+//remember that name was found in PATH dir i
+void cache_cmd(const char *name, int i){
+    //relative dirs follow the current directory, not worth caching
+    if(i < 0 || i >= path_dir_count || path_dirs[i].fd == AT_FDCWD)
+        return;
+    unsigned int h = name_hash(name, strlen(name)) % CMD_BUCKETS;
+    cmd_entry *e = (cmd_entry *)malloc(sizeof(cmd_entry));
+    if(e == NULL)
+        return;
+    e->name = strdup(name);
+    e->dirfd = path_dirs[i].fd;
+    e->dir = i;
+    e->path = NULL;
+    /* The PATH handles are close-on-exec, and a script's interpreter
+       would be handed /dev/fd/N/name to open.  Look once, here, so only
+       scripts are exec'd by their full path.  */
+    char magic[2];
+    int fd = openat(e->dirfd, name, O_RDONLY | O_CLOEXEC);
+    if(fd >= 0){
+        if(read(fd, magic, 2) == 2 && magic[0] == '#' && magic[1] == '!'){
+            e->path = (char *)malloc(strlen(path_dirs[i].name) + strlen(name) + 2);
+            if(e->path)
+                sprintf(e->path, "%s/%s", path_dirs[i].name, name);
+        }
+        close(fd);
+    }
+    e->next = cmd_table[h];
+    cmd_table[h] = e;
+}
+
+//where the command cache is kept between runs
+void disk_cache_path(char *out, size_t len){
+    char *file = get_var("WSH_CMDCACHE");
+    char *home = get_var("HOME");
+    if(file != NULL)
+        snprintf(out, len, "%s", file);
+    else
+        snprintf(out, len, "%s/.wsh_cmdcache", home ? home : "/tmp");
+}
+
+//name_hash of the current PATH, what the disk cache was built for
+unsigned int path_hash(void){
+    char *value = get_var("PATH");
+    if(value == NULL)
+        value = "/usr/bin:/bin";
+    return name_hash(value, strlen(value));
+}
+
+//map the saved command cache, dropping it unless it matches our PATH dirs
+void load_disk_cache(void){
+    char file[4096];
+    struct stat st;
+    disk_cache_header *h;
+    disk_cache_dir *dirs;
+
+    if(disk_cache){
+        munmap(disk_cache, disk_cache_len);
+        disk_cache = NULL;
+    }
+    disk_cache_path(file, sizeof(file));
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return;
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(disk_cache_header)){
+        close(fd);
+        return;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return;
+
+    h = (disk_cache_header *)map;
+    dirs = (disk_cache_dir *)(h + 1);
+    size_t need = sizeof(*h) + (size_t)h->ndirs * sizeof(disk_cache_dir)
+                  + (size_t)h->nslots * sizeof(disk_cache_slot);
+    int ok = h->magic == DISK_CACHE_MAGIC && h->path_hash == path_hash()
+             && (int)h->ndirs == path_dir_count && need <= (size_t)st.st_size
+             && h->nslots > 0 && (h->nslots & (h->nslots - 1)) == 0;
+    for(int i = 0; ok && i < path_dir_count; i++){
+        struct stat *d = &path_dirs[i].st;
+        ok = dirs[i].mtime_sec == d->st_mtim.tv_sec
+             && dirs[i].mtime_nsec == d->st_mtim.tv_nsec
+             && dirs[i].dev == d->st_dev && dirs[i].ino == d->st_ino;
+    }
+    if(!ok){
+        munmap(map, st.st_size);
+        return;
+    }
+    disk_cache = map;
+    disk_cache_len = st.st_size;
+}
+
+//forget_cmd() found name's cached dir wrong
+int is_stale_cmd(const char *name){
+    for(cmd_entry *e = stale_cmds; e; e = e->next){
+        if(strcmp(e->name, name) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+//PATH dir index of name in the mapped cache, or -1
+int disk_cache_lookup(const char *name){
+    if(disk_cache == NULL || is_stale_cmd(name))
+        return -1;
+    disk_cache_header *h = (disk_cache_header *)disk_cache;
+    disk_cache_slot *slots = (disk_cache_slot *)((disk_cache_dir *)(h + 1) + h->ndirs);
+    unsigned int mask = h->nslots - 1;
+    unsigned int i = name_hash(name, strlen(name)) & mask;
+
+    for(unsigned int probes = 0; probes < h->nslots; probes++, i = (i + 1) & mask){
+        if(slots[i].name_off == 0)
+            return -1;
+        if(slots[i].name_off < disk_cache_len
+           && strncmp(disk_cache + slots[i].name_off, name, disk_cache_len - slots[i].name_off) == 0){
+            return slots[i].dir < path_dir_count ? slots[i].dir : -1;
+        }
+    }
+    return -1;
+}
+
+/* Write the command cache out for the next shell if we learned anything.
+   Entries still only in the mapped file are carried over.  */
+void save_disk_cache(void){
+    char file[4096], tmp[4200];
+    cmd_entry *e;
+    int count = 0;
+
+    if(!cmd_cache_dirty)
+        return;
+    //everything in the mapped file is worth keeping too
+    if(disk_cache){
+        disk_cache_header *h = (disk_cache_header *)disk_cache;
+        disk_cache_slot *slots = (disk_cache_slot *)((disk_cache_dir *)(h + 1) + h->ndirs);
+        for(unsigned int i = 0; i < h->nslots; i++){
+            if(slots[i].name_off == 0)
+                continue;
+            const char *name = disk_cache + slots[i].name_off;
+            if(is_stale_cmd(name))
+                continue;
+            unsigned int b = name_hash(name, strlen(name)) % CMD_BUCKETS;
+            for(e = cmd_table[b]; e; e = e->next){
+                if(strcmp(e->name, name) == 0)
+                    break;
+            }
+            if(e == NULL)
+                cache_cmd(name, slots[i].dir);
+        }
+    }
+    for(int b = 0; b < CMD_BUCKETS; b++){
+        for(e = cmd_table[b]; e; e = e->next){
+            count++;
+        }
+    }
+
+    unsigned int nslots = 16;
+    while(nslots < (unsigned int)count * 2){
+        nslots *= 2;
+    }
+    size_t strings = sizeof(disk_cache_header) + path_dir_count * sizeof(disk_cache_dir)
+                     + nslots * sizeof(disk_cache_slot);
+    size_t len = strings;
+    for(int b = 0; b < CMD_BUCKETS; b++){
+        for(e = cmd_table[b]; e; e = e->next){
+            len += strlen(e->name) + 1;
+        }
+    }
+    char *out = (char *)calloc(1, len);
+    if(out == NULL)
+        return;
+
+    disk_cache_header *h = (disk_cache_header *)out;
+    disk_cache_dir *dirs = (disk_cache_dir *)(h + 1);
+    disk_cache_slot *slots = (disk_cache_slot *)(dirs + path_dir_count);
+    h->magic = DISK_CACHE_MAGIC;
+    h->path_hash = path_hash();
+    h->ndirs = path_dir_count;
+    h->nslots = nslots;
+    for(int i = 0; i < path_dir_count; i++){
+        dirs[i].mtime_sec = path_dirs[i].st.st_mtim.tv_sec;
+        dirs[i].mtime_nsec = path_dirs[i].st.st_mtim.tv_nsec;
+        dirs[i].dev = path_dirs[i].st.st_dev;
+        dirs[i].ino = path_dirs[i].st.st_ino;
+    }
+    size_t off = strings;
+    for(int b = 0; b < CMD_BUCKETS; b++){
+        for(e = cmd_table[b]; e; e = e->next){
+            unsigned int i = name_hash(e->name, strlen(e->name)) & (nslots - 1);
+            while(slots[i].name_off != 0){
+                i = (i + 1) & (nslots - 1);
+            }
+            slots[i].name_off = off;
+            slots[i].dir = e->dir;
+            strcpy(out + off, e->name);
+            off += strlen(e->name) + 1;
+        }
+    }
+
+    //write a private copy and rename it over, other shells may be reading
+    disk_cache_path(file, sizeof(file));
+    snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd >= 0){
+        if(write(fd, out, len) == (ssize_t)len && close(fd) == 0)
+            rename(tmp, file);
+        else
+            unlink(tmp);
+    }
+    free(out);
+    cmd_cache_dirty = 0;
+}
+
+/* Reopen the PATH directories after PATH changed.  Absolute entries are
+   walked once here, symlinks and all, and every later lookup and exec
+   starts from the handle instead of walking the path again.  */
+void open_path_dirs(void){
+    char *value = get_var("PATH");
+    char *copy, *dir, *save;
+
+    for(int i = 0; i < path_dir_count; i++){
+        if(path_dirs[i].fd != AT_FDCWD)
+            close(path_dirs[i].fd);
+        free(path_dirs[i].name);
+    }
+    free(path_dirs);
+    path_dirs = NULL;
+    path_dir_count = 0;
+    clear_cmd_cache();
+    path_dirty = 0;
+
+    //same two dirs we always searched if there is no PATH
+    copy = strdup(value ? value : "/usr/bin:/bin");
+    int count = 1;
+    for(char *c = copy; *c; c++){
+        if(*c == ':')
+            count++;
+    }
+    path_dirs = (path_dir *)calloc(count, sizeof(path_dir));
+    if(path_dirs == NULL){
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for(dir = copy; dir; dir = save){
+        save = strchr(dir, ':');
+        if(save)
+            *save++ = '\0';
+        int fd = AT_FDCWD;
+        //relative entries follow the current directory, keep them as names
+        if(dir[0] == '/'){
+            fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+            if(fd < 0)
+                continue;   //missing dirs can't hold anything
+        }
+        path_dirs[path_dir_count].fd = fd;
+        path_dirs[path_dir_count].name = strdup(dir[0] ? dir : ".");
+        memset(&path_dirs[path_dir_count].st, 0, sizeof(struct stat));
+        if(fd != AT_FDCWD)
+            fstat(fd, &path_dirs[path_dir_count].st);
+        path_dir_count++;
+    }
+    free(copy);
+    load_disk_cache();
+}
+
+/* Fill in p->exec_dirfd and p->exec_name for p->argv[0].  Names with a
+   '/' are used as is and cached commands come from the table.  Anything
+   else leaves exec_name NULL so the child tries each PATH dir itself;
+   the shell learns where it was found from the exec report.  */
+void get_path(process *p){
+    char *name = p->argv[0];
+    unsigned int h;
+    cmd_entry *e;
+
+    p->exec_dirfd = AT_FDCWD;
+    p->exec_name = NULL;
+    p->exec_cached = 0;
+    p->exec_path = NULL;
+    p->function = p->group ? p->group : find_function(name);
+    p->stage_builtin = p->function ? NULL : find_stage_builtin(p->argv);
+    if(p->function != NULL || p->stage_builtin != NULL || strchr(name, '/') != NULL){
+        p->exec_name = name;
+        return;
+    }
+    if(path_dirty)
+        open_path_dirs();
+
+    h = name_hash(name, strlen(name)) % CMD_BUCKETS;
+    for(e = cmd_table[h]; e; e = e->next){
+        if(strcmp(e->name, name) == 0){
+            p->exec_dirfd = e->dirfd;
+            p->exec_name = e->name;
+            p->exec_path = e->path;
+            p->exec_cached = 1;
+            stats.path_hits++;
+            return;
+        }
+    }
+
+    //an earlier shell may have found it already
+    int dir = disk_cache_lookup(name);
+    if(dir >= 0 && path_dirs[dir].fd != AT_FDCWD){
+        cache_cmd(name, dir);
+        p->exec_dirfd = path_dirs[dir].fd;
+        p->exec_name = cmd_table[h]->name;
+        p->exec_path = cmd_table[h]->path;
+        p->exec_cached = 1;
+        stats.path_hits++;
+        return;
+    }
+    stats.path_misses++;
+}
+
+/* Forget a cached lookup that went stale.  The mapped disk cache can't
+   be changed, so the name is also kept out of it for the rest of the
+   session, and the file is rewritten without it.  */
+void forget_cmd(const char *name){
+    unsigned int h = name_hash(name, strlen(name)) % CMD_BUCKETS;
+    cmd_entry **link = &cmd_table[h];
+    cmd_entry *e;
+
+    if(disk_cache && !is_stale_cmd(name)){
+        e = (cmd_entry *)calloc(1, sizeof(cmd_entry));
+        if(e){
+            e->name = strdup(name);
+            e->next = stale_cmds;
+            stale_cmds = e;
+        }
+    }
+    cmd_cache_dirty = 1;
+    for(e = *link; e; link = &e->next, e = e->next){
+        if(strcmp(e->name, name) == 0){
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            return;
+        }
+    }
+}
+
+//hash [-r]: list the cached command lookups or forget them
+int hash_cmds(char *args[]){
+    cmd_entry *e;
+    if(args[0] != NULL && strcmp(args[0], "-r") == 0){
+        clear_cmd_cache();
+        //the saved copy would hand the same answers back
+        if(disk_cache){
+            munmap(disk_cache, disk_cache_len);
+            disk_cache = NULL;
+        }
+        return 0;
+    }
+    for(int b = 0; b < CMD_BUCKETS; b++){
+        for(e = cmd_table[b]; e; e = e->next){
+            printf("%s/%s\n", path_dirs[e->dir].name, e->name);
+        }
+    }
+    return 0;
+}
+
+/* Fork and exec one stage of j.  The child reports failed exec attempts
+   on a CLOEXEC pipe, so reading it to EOF tells us the exec happened.
+   Returns 0 once p is running, or the errno that kept it from starting
+   (the failed child is reaped before returning).  */
+int spawn_process(job *j, process *p, int infile, int outfile, char **envp){
+    int errpipe[2];
+    exec_report r;
+    int last_dir = -1;
+    int err = 0;
+    pid_t pid;
+
+    get_path(p);
+    if(pipe2(errpipe, O_CLOEXEC) < 0){
+        perror("pipe");
+        exit(1);
+    }
+    if(perf_on && pipe2(perf_go, O_CLOEXEC) < 0){
+        perror("pipe");
+        exit(1);
+    }
+    //fork the child processes
+    long long before = now_ns();
+    pid = j->cgroup_fd >= 0 ? fork_into_cgroup(j->cgroup_fd) : fork();
+    if(pid == 0){
+        //this is the child process
+        close(errpipe[0]);
+        launch_process(p,j->pgid, infile, outfile, j->stderr, j->curr_bg, envp, errpipe[1]);
+    }
+    else if(pid < 0){
+        //the fork failed
+        perror("fork");
+        exit(1);
+    }
+    fork_ns_last = now_ns() - before;
+    fork_ns_total += fork_ns_last;
+    if(fork_ns_last > fork_ns_max)
+        fork_ns_max = fork_ns_last;
+    fork_count++;
+    close(errpipe[1]);
+    if(perf_go[0] >= 0){
+        //builtins and functions never exec, count them from now
+        perf_attach(p, pid, !(p->function || p->stage_builtin));
+        close(perf_go[0]);
+        close(perf_go[1]);
+        perf_go[0] = perf_go[1] = -1;
+    }
+
+    //this is the parent process
+    p->pid = pid;
+    if(shell_is_interactive || spawn_own_group){
+        if(!j->pgid){
+            j->pgid = pid;
+        }
+        setpgid(pid, j->pgid);
+    }
+
+    //EOF means the exec worked, records are the attempts that didn't
+    while(read(errpipe[0], &r, sizeof(r)) == sizeof(r)){
+        if(r.dir < 0){
+            err = r.err;
+            break;
+        }
+        last_dir = r.dir;
+    }
+    close(errpipe[0]);
+
+    if(err == 0){
+        p->started_ns = now_ns();
+        hist_record(&stats.spawn, p->started_ns - before);
+        if(!p->function && !p->stage_builtin)
+            stats.execs++;
+        //a PATH search succeeded in the dir after the last failed one
+        if(p->exec_name == NULL){
+            cache_cmd(p->argv[0], last_dir + 1);
+            cmd_cache_dirty = 1;
+        }
+        return 0;
+    }
+
+    //the failed child never ran anything, reap it now
+    stats.exec_failures++;
+    waitpid(pid, NULL, 0);
+    p->pid = 0;
+    if(j->pgid == pid)
+        j->pgid = 0;
+    return err;
+}
+
+//stop the stages of j that already started, the rest never will
+void teardown_job(job *j){
+    process *p;
+    for(p = j->first_process; p; p = p->next){
+        if(p->pid > 0 && !p->completed){
+            p->torn_down = 1;
+            kill(p->pid, SIGTERM);
+        }
+    }
+}
+
+/* Deadlines.  timeout DURATION cmd, or WSH_TIMEOUT for every job, arms
+   a timerfd the event loop watches.  When it fires the job's group gets
+   SIGTERM (or timeout -s), and if it is still around after the grace
+   period, WSH_KILL_AFTER or timeout -k, SIGKILL.  */
+#define TIMEOUT_GRACE 5000000000LL  //SIGTERM to SIGKILL unless told otherwise
+
+/* 1.5, 30s, 2m, 1h or 1d in nanoseconds, -1 if s isn't one.  */
+long long parse_duration(const char *s){
+    char *end;
+    double value = strtod(s, &end);
+    double unit = 1e9;
+
+    if(end == s || value < 0)
+        return -1;
+    switch(*end){
+    case '\0':
+    case 's':
+        break;
+    case 'm':
+        unit *= 60;
+        break;
+    case 'h':
+        unit *= 3600;
+        break;
+    case 'd':
+        unit *= 86400;
+        break;
+    default:
+        return -1;
+    }
+    if(*end && end[1])
+        return -1;
+    return (long long)(value * unit);
+}
+
+void arm_timer(int fd, long long ns){
+    struct itimerspec when;
+    memset(&when, 0, sizeof(when));
+    when.it_value.tv_sec = ns / 1000000000;
+    when.it_value.tv_nsec = ns % 1000000000;
+    if(ns <= 0)
+        when.it_value.tv_nsec = 1;     //zero would disarm it
+    timerfd_settime(fd, 0, &when, NULL);
+}
+
+//the job's deadline or its grace period ran out
+void job_timer_fired(int fd, void *data){
+    job *j = (job *)data;
+    unsigned long long ticks;
+
+    if(read(fd, &ticks, sizeof(ticks)) < 0 && errno == EAGAIN)
+        return;
+    if(job_is_completed(j)){
+        stop_job_timer(j);
+        return;
+    }
+    int sig = j->timed_out ? SIGKILL : j->timeout_signal;
+    if(j->pgid > 0){
+        kill(-j->pgid, sig);
+        kill(-j->pgid, SIGCONT);
+    }
+    else{
+        for(process *p = j->first_process; p; p = p->next){
+            if(p->pid > 0 && !p->completed)
+                kill(p->pid, sig);
+        }
+    }
+    if(!j->timed_out && sig != SIGKILL && j->grace_ns > 0){
+        j->timed_out = 1;
+        arm_timer(fd, j->grace_ns);
+        return;
+    }
+    j->timed_out = 1;
+    stop_job_timer(j);
+}
+
+//the deadline j runs under, from timeout or WSH_TIMEOUT
+void set_deadline(job *j){
+    j->timeout_ns = next_timeout_ns;
+    j->grace_ns = next_grace_ns;
+    j->timeout_signal = next_timeout_signal;
+    //timeout's deadline is for the first job only, not the ones memo... starts
+    next_timeout_ns = 0;
+    next_grace_ns = -1;
+    next_timeout_signal = SIGTERM;
+    if(j->timeout_ns == 0){
+        char *value = get_var("WSH_TIMEOUT");
+        if(value && value[0])
+            j->timeout_ns = parse_duration(value);
+        if(j->timeout_ns < 0){
+            fprintf(stderr, "wsh: WSH_TIMEOUT: %s: invalid duration\n", value);
+            j->timeout_ns = 0;
+        }
+    }
+    if(j->timeout_ns > 0 && j->grace_ns < 0){
+        char *value = get_var("WSH_KILL_AFTER");
+        j->grace_ns = value && value[0] ? parse_duration(value) : TIMEOUT_GRACE;
+        if(j->grace_ns < 0)
+            j->grace_ns = TIMEOUT_GRACE;
+    }
+}
+
+void start_job_timer(job *j){
+    if(j->timeout_ns <= 0 || job_is_completed(j))
+        return;
+    j->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if(j->timer_fd < 0){
+        perror("wsh: timerfd");
+        return;
+    }
+    arm_timer(j->timer_fd, j->timeout_ns - (now_ns() - j->launched_ns));
+    add_watch(j->timer_fd, job_timer_fired, j);
+}
+
+struct { const char *name; int sig; } signal_names[] = {
+    {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+    {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"ALRM", SIGALRM}, {"TERM", SIGTERM},
+    {NULL, 0}
+};
+
+//a signal by number, NAME or SIGNAME, -1 if unknown
+int parse_signal(const char *s){
+    if(s[0] >= '0' && s[0] <= '9')
+        return atoi(s) > 0 && atoi(s) < NSIG ? atoi(s) : -1;
+    if(strncmp(s, "SIG", 3) == 0)
+        s += 3;
+    for(int i = 0; signal_names[i].name; i++){
+        if(strcmp(signal_names[i].name, s) == 0)
+            return signal_names[i].sig;
+    }
+    return -1;
+}
+
+//builtins that run in the shell itself, no process for a deadline to stop
+const char *untimed_builtins[] = {
+    "exit", "cd", "export", "hash", "unset", "return", "jobs", "stats", "forkstat",
+    "output", "coproc", "read", "wait", "set", "fg", "bg", NULL
+};
+
+int untimed_builtin(char *command, char *args[]){
+    for(int i = 0; untimed_builtins[i]; i++){
+        if(strcmp(untimed_builtins[i], command) == 0)
+            return 1;
+    }
+    return only_assignments(command, args);
+}
+
+/* timeout [-k GRACE] [-s SIGNAL] DURATION cmd...: run the rest of the
+   line as a job with a deadline.  Returns the index of cmd in args, or
+   -1 after saying why it can't.  The deadline is left in next_timeout_ns
+   for launch_job() to pick up.  */
+int parse_timeout(char *args[]){
+    int i = 0;
+    next_grace_ns = -1;
+    next_timeout_signal = SIGTERM;
+    for(; args[i] && args[i][0] == '-' && args[i][1]; i++){
+        if(strcmp(args[i], "-k") == 0 && args[i+1]){
+            next_grace_ns = parse_duration(args[++i]);
+            if(next_grace_ns < 0){
+                fprintf(stderr, "timeout: %s: invalid duration\n", args[i]);
+                return -1;
+            }
+        }
+        else if(strcmp(args[i], "-s") == 0 && args[i+1]){
+            next_timeout_signal = parse_signal(args[++i]);
+            if(next_timeout_signal < 0){
+                fprintf(stderr, "timeout: %s: invalid signal\n", args[i]);
+                return -1;
+            }
+        }
+        else{
+            fprintf(stderr, "timeout: usage: timeout [-k GRACE] [-s SIGNAL] DURATION cmd...\n");
+            return -1;
+        }
+    }
+    if(args[i] == NULL || args[i+1] == NULL){
+        fprintf(stderr, "timeout: usage: timeout [-k GRACE] [-s SIGNAL] DURATION cmd...\n");
+        return -1;
+    }
+    next_timeout_ns = parse_duration(args[i]);
+    if(next_timeout_ns < 0){
+        fprintf(stderr, "timeout: %s: invalid duration\n", args[i]);
+        next_timeout_ns = 0;
+        return -1;
+    }
+    //timeout 0 means no deadline, as with coreutils
+    return i + 1;
+}
+
+/* Long pipelines start concurrently.  Every stage is looked up and
+   every pipe made first, then the stages are started with a vfork-style
+   clone: the child borrows our memory until its exec, so no page tables
+   are copied and we only wait for the exec itself.  With more than one
+   CPU the stages are split over a few threads spawning side by side.
+   Only plain external stages go this way, functions, builtins,
+   redirections and VAR=x still need a forked child.  */
+#define SPAWN_CONCURRENT_AT 4       //stages before a pipeline starts this way
+#define SPAWN_THREADS 4
+#define SPAWN_STACK 65536           //what a child uses before its exec
+
+typedef struct spawn_stage{
+    process *p;
+    pid_t pgid;                 //0 for the first stage, which leads the group
+    int infile, outfile, errfile;
+    int foreground;
+    char **envp;
+    sigset_t mask;              //the mask to exec with
+    int err;                    //set by the child when its exec failed
+    int dir;                    //PATH dir the child searched up to, -1 for none
+    long long spawn_ns;         //how long starting it took
+} spawn_stage;
+
+typedef struct spawn_batch{
+    spawn_stage *stages;
+    int first, count, stride;
+    char *stack;
+} spawn_batch;
+
+char *spawn_stacks = NULL;      //one per thread, kept once made
+
+/* The child side, on its own stack in our memory.  Every signal is
+   blocked until the handlers are back to default, or one could run
+   here on the shell's data.  */
+int spawn_child(void *data){
+    spawn_stage *s = (spawn_stage *)data;
+    process *p = s->p;
+
+    if(!shell_is_interactive && spawn_own_group)
+        setpgid(0, s->pgid);
+    if(shell_is_interactive){
+        pid_t pgid = s->pgid ? s->pgid : getpid();
+        setpgid(0, pgid);
+        if(s->foreground)
+            tcsetpgrp(shell_terminal, pgid);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+    }
+    signal(SIGCHLD, SIG_DFL);
+
+    if(s->infile != STDIN_FILENO)
+        dup2(s->infile, STDIN_FILENO);
+    if(s->outfile != STDOUT_FILENO)
+        dup2(s->outfile, STDOUT_FILENO);
+    if(s->errfile != STDERR_FILENO)
+        dup2(s->errfile, STDERR_FILENO);
+    if(s->infile > STDERR_FILENO)
+        close(s->infile);
+    if(s->outfile > STDERR_FILENO)
+        close(s->outfile);
+    if(s->errfile > STDERR_FILENO && s->errfile != s->outfile)
+        close(s->errfile);
+
+    if(spawn_nlimits && (s->err = apply_limits(spawn_limits, spawn_nlimits)) != 0)
+        _exit(126);
+    sigprocmask(SIG_SETMASK, &s->mask, NULL);
+    //we share the parent's memory, s->dir says where a search succeeded
+    s->err = exec_process(p, s->envp, -1, &s->dir);
+    _exit(s->err == ENOENT ? 127 : 126);
+}
+
+//start one stage, returns its pid with s->err set if the exec failed
+pid_t spawn_stage_now(spawn_stage *s, char *stack){
+    sigset_t all;
+    pid_t pid;
+
+    long long before = now_ns();
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &s->mask);
+    s->err = 0;
+    s->dir = -1;
+    pid = clone(spawn_child, stack + SPAWN_STACK, CLONE_VM | CLONE_VFORK | SIGCHLD, s);
+    if(pid < 0)
+        s->err = errno;
+    else if(shell_is_interactive || spawn_own_group)
+        setpgid(pid, s->pgid ? s->pgid : pid);
+    pthread_sigmask(SIG_SETMASK, &s->mask, NULL);
+    s->p->started_ns = now_ns();
+    s->spawn_ns = s->p->started_ns - before;
+    return pid;
+}
+
+void *spawn_worker(void *data){
+    spawn_batch *b = (spawn_batch *)data;
+    for(int i = b->first; i < b->count; i += b->stride)
+        b->stages[i].p->pid = spawn_stage_now(&b->stages[i], b->stack);
+    return NULL;
+}
+
+/* How many stages j has if it can start concurrently, else 0.  Looks
+   every stage up in the cache on the way, the children search PATH for
+   the rest.  */
+int spawn_concurrently(job *j){
+    int n = 0;
+    //counters need the child to wait for us, see perf_attach(), and
+    //these clones share our stack so they can't be clone3'd into a cgroup
+    if(perf_on || j->cgroup_fd >= 0)
+        return 0;
+    for(process *p = j->first_process; p; p = p->next, n++){
+        get_path(p);
+        if(p->function || p->stage_builtin || p->nredirs || p->assigns)
+            return 0;
+    }
+    return n >= SPAWN_CONCURRENT_AT ? n : 0;
+}
+
+/* Start the n stages of j concurrently, pipes and all.  A stage that
+   can't exec fails the job the way launch_job() does, the stages
+   already running are stopped.  */
+void launch_concurrently(job *j, int n, char **envp){
+    spawn_stage *stages = (spawn_stage *)calloc(n, sizeof(spawn_stage));
+    int (*pipes)[2] = (int (*)[2])malloc(n * sizeof(int[2]));
+    process *p;
+    int i, threads;
+
+    if(spawn_stacks == NULL){
+        spawn_stacks = (char *)shell_map(SPAWN_THREADS * SPAWN_STACK);
+        if(spawn_stacks == NULL){
+            perror("wsh: spawn");
+            exit(1);
+        }
+    }
+
+    //every pipe first, so the stages don't depend on each other
+    for(i = 0, p = j->first_process; p; p = p->next, i++){
+        stages[i].p = p;
+        stages[i].envp = envp;
+        stages[i].errfile = j->stderr;
+        stages[i].foreground = !j->curr_bg;
+        stages[i].infile = i ? pipes[i-1][0] : j->stdin;
+        if(p->next){
+            if(pipe2(pipes[i], O_CLOEXEC) < 0){
+                perror("pipe");
+                exit(1);
+            }
+            stages[i].outfile = pipes[i][1];
+        }
+        else{
+            stages[i].outfile = j->stdout;
+        }
+    }
+
+    //the first stage makes the process group the others join
+    p = j->first_process;
+    p->pid = spawn_stage_now(&stages[0], spawn_stacks);
+    if(p->pid > 0 && (shell_is_interactive || spawn_own_group))
+        j->pgid = p->pid;
+    for(i = 1; i < n; i++)
+        stages[i].pgid = j->pgid;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus < SPAWN_THREADS ? (int)cpus : SPAWN_THREADS;
+    if(threads > n - 1)
+        threads = n - 1;
+    if(threads <= 1 || p->pid < 0){
+        spawn_batch b = {stages, 1, p->pid < 0 ? 1 : n, 1, spawn_stacks};
+        spawn_worker(&b);
+    }
+    else{
+        pthread_t tids[SPAWN_THREADS];
+        spawn_batch batches[SPAWN_THREADS];
+        for(i = 0; i < threads; i++){
+            batches[i] = (spawn_batch){stages, 1 + i, n, threads, spawn_stacks + i * SPAWN_STACK};
+            if(pthread_create(&tids[i], NULL, spawn_worker, &batches[i]) != 0)
+                spawn_worker(&batches[i]);  //still done, just not side by side
+            else
+                batches[i].count = -1;
+        }
+        for(i = 0; i < threads; i++){
+            if(batches[i].count < 0)
+                pthread_join(tids[i], NULL);
+        }
+    }
+    vfork_count += n;
+
+    //a stale cache entry gets one more try, anything else fails the job
+    for(i = 0; i < n; i++){
+        spawn_stage *s = &stages[i];
+        p = s->p;
+        if(s->err == 0 || p->pid < 0)
+            continue;
+        waitpid(p->pid, NULL, 0);
+        if(s->err == ENOENT && p->exec_cached){
+            forget_cmd(p->argv[0]);
+            get_path(p);
+            s->pgid = j->pgid;
+            p->pid = spawn_stage_now(s, spawn_stacks);
+            if(s->err == 0)
+                continue;
+            if(p->pid > 0)
+                waitpid(p->pid, NULL, 0);
+        }
+        p->pid = 0;
+    }
+    for(i = 0; i < n; i++){
+        int err = stages[i].err;
+        p = stages[i].p;
+        if(err == 0 && p->pid > 0){
+            hist_record(&stats.spawn, stages[i].spawn_ns);
+            stats.execs++;
+            //the child found it in PATH, the next run won't have to look
+            if(p->exec_name == NULL && stages[i].dir >= 0){
+                cache_cmd(p->argv[0], stages[i].dir);
+                cmd_cache_dirty = 1;
+            }
+            continue;
+        }
+        p->started_ns = 0;
+        if(err)
+            stats.exec_failures++;
+        //no error means it never got started, the first stage failed
+        if(err == ENOENT)
+            fprintf(stderr, "wsh: %s: command not found\n", p->argv[0]);
+        else if(err)
+            fprintf(stderr, "wsh: %s: %s\n", p->argv[0], strerror(err));
+        p->pid = 0;
+        p->completed = 1;
+        p->status = err ? W_EXITCODE(err == ENOENT ? 127 : 126, 0) : 0;
+        if(err && !j->launch_status)
+            j->launch_status = err == ENOENT ? 127 : 126;
+    }
+    if(j->launch_status){
+        teardown_job(j);
+        if(shell_is_interactive && !j->curr_bg)
+            tcsetpgrp(shell_terminal, shell_pgid);
+    }
+
+    for(i = 0; i < n - 1; i++){
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+    free(pipes);
+    free(stages);
+}
+
+//bytes kept per captured job, CAPTURE_SIZE overrides the default
+size_t capture_size(void){
+    char *value = get_var("CAPTURE_SIZE");
+    long size = value ? atol(value) : 0;
+    return size > 0 ? (size_t)size : CAPTURE_SIZE;
+}
+
+//the captured pipe of data (a job) is readable, keep its newest bytes
+void drain_output(int fd, void *data){
+    job *j = (job *)data;
+    char chunk[16384];
+    ssize_t n = 0;
+
+    //a few reads at most so one chatty job can't starve the loop
+    for(int i = 0; i < 4; i++){
+        n = read(fd, chunk, sizeof(chunk));
+        if(n <= 0)
+            break;
+        if(j->output == NULL){
+            first_byte_ns_last = now_ns() - j->launched_ns;
+            j->output = (ring *)calloc(1, sizeof(ring));
+            j->output->cap = capture_size();
+            j->output->data = (char *)shell_map(j->output->cap);
+        }
+        ring_write(j->output, chunk, n);
+    }
+    if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)){
+        //every writer is gone
+        remove_watch(fd);
+        close(fd);
+        j->capture_fd = -1;
+    }
+}
+
+/* Whether the stage builtin of p can run in the shell without holding
+   up anything: no other job, timer or capture is waiting on the event
+   loop, and everything it reads is a regular file, never a pipe or a
+   terminal that could keep it blocked.  */
+int stage_in_shell_ok(job *j, process *p){
+    for(job *o = first_job; o; o = o->next){
+        if(o != j && (!job_is_completed(o) || o->capture_fd >= 0 || o->timer_fd >= 0))
+            return 0;
+    }
+
+    //skip the options to get to the file operands
+    char **argv = p->argv;
+    int first = 1;
+    int bytes;
+    long long count;
+    if(strcmp(argv[0], "head") == 0 || strcmp(argv[0], "tail") == 0){
+        first = parse_head_tail(argv, &bytes, &count);
+    }
+    else{
+        for(; argv[first] && argv[first][0] == '-' && argv[first][1]; first++){
+            if(strcmp(argv[first], "--") == 0){
+                first++;
+                break;
+            }
+        }
+    }
+    int reads_stdin = argv[first] == NULL;
+    struct stat st;
+    for(int i = first; argv[i]; i++){
+        if(strcmp(argv[i], "-") == 0)
+            reads_stdin = 1;
+        else if(stat(argv[i], &st) < 0 || !S_ISREG(st.st_mode))
+            return 0;
+    }
+    if(!reads_stdin)
+        return 1;
+
+    //stdin is the job's unless a redirect replaces it
+    int in = j->stdin;
+    const char *in_path = NULL;
+    for(int i = 0; i < p->nredirs; i++){
+        redirect *r = &p->redirs[i];
+        if(r->fd != STDIN_FILENO)
+            continue;
+        if(r->op == REDIR_DUP){
+            in = r->src;
+            in_path = NULL;
+        }
+        else if(r->op == REDIR_CLOSE){
+            in = -1;
+            in_path = NULL;
+        }
+        else{
+            in_path = r->path;
+        }
+    }
+    if(in_path)
+        return stat(in_path, &st) == 0 && S_ISREG(st.st_mode);
+    return in < 0 || (fstat(in, &st) == 0 && S_ISREG(st.st_mode));
+}
+
+//a variable as it was before a VAR=x prefix covered it
+typedef struct saved_var{
+    char *name;
+    char *value;        //NULL if it wasn't set
+    int exported;
+} saved_var;
+
+/* Set the VAR=x prefixes of an in-shell run as exported variables,
+   the way a child would see them in its environment.  Returns what
+   they covered, for pop_assigns() to put back.  */
+saved_var *push_assigns(char **assigns, int *count){
+    int n = 0;
+    while(assigns && assigns[n])
+        n++;
+    saved_var *saved = (saved_var *)malloc((n + 1) * sizeof(saved_var));
+    for(int i = 0; i < n; i++){
+        char *eq = strchr(assigns[i], '=');
+        saved[i].name = strndup(assigns[i], eq - assigns[i]);
+        var *v = find_var(saved[i].name, strlen(saved[i].name));
+        saved[i].value = v ? strdup(v->value) : NULL;
+        saved[i].exported = v ? v->exported : 0;
+        set_var(saved[i].name, eq + 1, 1);
+    }
+    *count = n;
+    return saved;
+}
+
+//undo push_assigns(), last one first so a name given twice ends up as it was
+void pop_assigns(saved_var *saved, int count){
+    for(int i = count - 1; i >= 0; i--){
+        if(saved[i].value == NULL){
+            unset_var(saved[i].name);
+        }
+        else{
+            set_var(saved[i].name, saved[i].value, 0);
+            var *v = find_var(saved[i].name, strlen(saved[i].name));
+            if(v->exported != saved[i].exported){
+                v->exported = saved[i].exported;
+                env_dirty = 1;
+            }
+        }
+        free(saved[i].name);
+        free(saved[i].value);
+    }
+    free(saved);
+}
+
+/* Run a lone foreground function, or a cat/head/tail/wc of a script,
+   right in the shell with the job's fds swapped in for the duration.
+   Returns 0 if p has to be forked after all.  Interactive shells fork
+   the file builtins, the shell ignores ^C and the user has to be able
+   to stop a long cat, and so does a script when stage_in_shell_ok()
+   says the builtin could block.  */
+int run_in_shell(job *j, process *p){
+    int saved[3];
+    int status;
+
+    get_path(p);
+    if(j->curr_bg || p->next)
+        return 0;
+    if(p->function == NULL && (shell_is_interactive || !p->stage_builtin || !p->stage_builtin->in_shell))
+        return 0;
+    if(p->function && p->function->forks)
+        return 0;
+    if(p->function == NULL && !stage_in_shell_ok(j, p))
+        return 0;
+    //only 0-2 are put back afterwards
+    for(int i = 0; i < p->nredirs; i++){
+        if(p->redirs[i].fd > STDERR_FILENO)
+            return 0;
+    }
+
+    fflush(stdout);
+    for(int fd = 0; fd < 3; fd++)
+        saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    if(j->stdin != STDIN_FILENO)
+        dup2(j->stdin, STDIN_FILENO);
+    if(j->stdout != STDOUT_FILENO)
+        dup2(j->stdout, STDOUT_FILENO);
+    if(j->stderr != STDERR_FILENO)
+        dup2(j->stderr, STDERR_FILENO);
+
+    int ncovered;
+    saved_var *covered = push_assigns(p->assigns, &ncovered);
+    if(apply_redirects(p) < 0){
+        status = 1;
+    }
+    else if(p->function){
+        status = call_function(p->function, p->group && positional ? positional : p->argv);
+    }
+    else{
+        //a reader that goes away is an error for the builtin, not the end of us
+        void (*old_pipe)(int) = signal(SIGPIPE, SIG_IGN);
+        status = p->stage_builtin->run(p->argv, get_envp());
+        signal(SIGPIPE, old_pipe);
+    }
+    pop_assigns(covered, ncovered);
+
+    for(int fd = 0; fd < 3; fd++){
+        if(saved[fd] >= 0){
+            dup2(saved[fd], fd);
+            close(saved[fd]);
+        }
+        else{
+            close(fd);
+        }
+    }
+    p->completed = 1;
+    p->status = W_EXITCODE(status, 0);
+    return 1;
+}
+
+/* The last command of a script or -c line doesn't need a child, the
+   shell would only wait for it and exit with its status.  Exec it in
+   place when it's a single external command with the shell's own fds.
+   Only returns if j can't be run this way.  */
+void exec_job_in_place(job *j){
+    process *p = j->first_process;
+
+    if(p->next || j->curr_bg || p->function || p->stage_builtin || shell_is_interactive || perf_on
+       || journal_ready()
+       || j->stdin != STDIN_FILENO || j->stdout != STDOUT_FILENO || j->stderr != STDERR_FILENO)
+        return;
+
+    fflush(stdout);
+    save_disk_cache();
+    remove_status_page();
+    if(apply_redirects(p) < 0)
+        exit(1);
+    char **envp = get_envp();
+    if(p->assigns)
+        layer_assigns(envp, p->assigns);
+
+    //no shell to read the exec reports, they go nowhere
+    int err = exec_process(p, envp, -1, NULL);
+    if(err == ENOENT && p->exec_cached){
+        forget_cmd(p->argv[0]);
+        get_path(p);
+        err = exec_process(p, envp, -1, NULL);
+    }
+    if(err == ENOENT)
+        fprintf(stderr, "wsh: %s: command not found\n", p->argv[0]);
+    else
+        fprintf(stderr, "wsh: %s: %s\n", p->argv[0], strerror(err));
+    exit(err == ENOENT ? 127 : 126);
+}
+
+void launch_job(job *j){
+    process *p;
+    int mypipe[2], infile, outfile;
+    int capture[2] = {-1, -1};
+
+    j->launched_ns = now_ns();
+    set_deadline(j);
+    j->limits = next_limits;
+    j->nlimits = next_nlimits;
+    next_limits = NULL;
+    next_nlimits = 0;
+    //with a deadline it needs a process to signal, with limits or a
+    //cgroup one to limit
+    if(j->timeout_ns == 0 && j->nlimits == 0 && !next_cgroup && run_in_shell(j, j->first_process))
+        return;
+    stats.jobs_launched++;
+    if(exec_in_place && j->timeout_ns == 0 && j->nlimits == 0 && !next_cgroup && !cgroup_on)
+        exec_job_in_place(j);
+    make_job_cgroup(j);
+    spawn_own_group = j->timeout_ns > 0;
+    spawn_limits = j->limits;
+    spawn_nlimits = j->nlimits;
+
+    //with set -o capture the shell owns a background job's output, if
+    //it was going to the shell's own (a coprocess's goes to its pipe)
+    if(j->curr_bg && capture_bg && !j->owned && j->stdout == STDOUT_FILENO){
+        if(pipe2(capture, O_CLOEXEC) < 0){
+            perror("pipe");
+        }
+        else{
+            j->stdout = capture[1];
+            j->stderr = capture[1];
+        }
+    }
+
+    infile = j->stdin;
+    //don't let the children inherit unflushed output
+    fflush(stdout);
+    //snapshot is shared by every stage, only rebuilt if an export changed
+    char **envp = get_envp();
+
+    int concurrent = spawn_concurrently(j);
+    if(concurrent)
+        launch_concurrently(j, concurrent, envp);
+
+    //loop through 
+    for (p = concurrent ? NULL : j->first_process; p; p=p->next){
+        //set up pipes if necessary
+        if(p->next){
+            //CLOEXEC so no other stage holds on to this pipe's ends
+            if(pipe2 (mypipe, O_CLOEXEC) <0){
+                perror ("pipe");
+                exit(1);
+            }
+            outfile = mypipe[1];
+        }
+        else{
+            outfile = j->stdout;
+        }
+
+        int err = spawn_process(j, p, infile, outfile, envp);
+        if(err == ENOENT && p->exec_cached){
+            //the command moved since we cached it, search PATH again
+            forget_cmd(p->argv[0]);
+            err = spawn_process(j, p, infile, outfile, envp);
+        }
+        if(err != 0){
+            j->launch_status = err == ENOENT ? 127 : 126;
+            if(err == ENOENT)
+                fprintf(stderr, "wsh: %s: command not found\n", p->argv[0]);
+            else
+                fprintf(stderr, "wsh: %s: %s\n", p->argv[0], strerror(err));
+            //close our ends, nothing will use them now
+            if(outfile != j->stdout){
+                close(outfile);
+                close(mypipe[0]);
+            }
+            if(infile != j->stdin){
+                close(infile);
+            }
+            //the failed stage and the ones after it never run, but they
+            //keep their place in PIPESTATUS: 127 or 126, then 0 like bash
+            p->completed = 1;
+            p->status = W_EXITCODE(j->launch_status, 0);
+            for(process *q = p->next; q; q = q->next){
+                q->pid = 0;
+                q->completed = 1;
+                q->status = 0;
+            }
+            teardown_job(j);
+            if(shell_is_interactive && !j->curr_bg)
+                tcsetpgrp(shell_terminal, shell_pgid);
+            break;
+        }
+        //clean up after pipes
+        if(infile != j->stdin){
+            close(infile);
+        }
+        if(outfile != j->stdout){
+            close(outfile);
+        }
+        infile = mypipe[0];
+    }
+
+    spawn_own_group = 0;
+    spawn_nlimits = 0;
+    start_job_timer(j);
+    publish_job(j);
+    journal_job_start(j);
+    //a job that never got a process running is over already
+    if(job_is_completed(j))
+        journal_job_end(j);
+    pipeline_ns_last = now_ns() - j->launched_ns;
+    pipeline_concurrent_last = concurrent != 0;
+    pipeline_stages_last = 0;
+    for(p = j->first_process; p; p = p->next)
+        pipeline_stages_last++;
+
+    if(capture[1] >= 0){
+        //only the children write to it now
+        close(capture[1]);
+        j->stdout = STDOUT_FILENO;
+        j->stderr = STDERR_FILENO;
+        fcntl(capture[0], F_SETFL, O_NONBLOCK);
+        j->capture_fd = capture[0];
+        add_watch(capture[0], drain_output, j);
+    }
+
+    //only worth saying at a prompt, scripts and -c stay quiet
+    if(shell_is_interactive && !j->owned)
+        format_job_info(j, "launched");
+
+    //nothing left running if the first stage couldn't start
+    if(job_is_completed(j)){
+        return;
+    }
+    if(j->curr_bg){
+        put_job_in_background(j, 0);
+    }
+    else if(!shell_is_interactive){
+        wait_for_job(j);
+    }
+    else{
+        put_job_in_foreground(j, 0);
+    }
+}
+
+
+//TODO: this needs to parse the 
+//split the line in buffer into command and args, expanding $VAR in each word
+void parse_process(char* command, char* args[]){
+    char *tokens[MAX_ARGS + 2];
+    buffer[strcspn(buffer, "\n")] = '\0';
+    split_words(buffer, tokens, MAX_ARGS + 1);
+    expand_tokens(tokens, command, args);
+}
+
+/* If word is a redirection like <file, 2>>log, >&3 or 2>&-, add it to p.
+   The target may also be the next word.  Returns how many words it
+   used, 0 when word isn't a redirection and -1 on a bad one.  */
+int parse_redirect(process *p, char *word, char *next){
+    redirect r;
+    char *c = word;
+    int used = 1;
+
+    r.fd = -1;
+    r.src = -1;
+    r.path = NULL;
+    if(*c >= '0' && *c <= '9'){
+        r.fd = 0;
+        while(*c >= '0' && *c <= '9')
+            r.fd = r.fd * 10 + (*c++ - '0');
+    }
+    if(*c != '<' && *c != '>')
+        return 0;
+
+    int in = *c == '<';
+    if(r.fd < 0)
+        r.fd = in ? STDIN_FILENO : STDOUT_FILENO;
+    if(c[1] == '&'){
+        r.op = REDIR_DUP;
+        c += 2;
+    }
+    else if(!in && c[1] == '>'){
+        r.op = REDIR_APPEND;
+        c += 2;
+    }
+    else{
+        r.op = in ? REDIR_IN : REDIR_OUT;
+        c += 1;
+    }
+    if(*c == '\0'){
+        if(next == NULL){
+            fprintf(stderr, "wsh: syntax error near '%s'\n", word);
+            return -1;
+        }
+        c = next;
+        used = 2;
+    }
+
+    if(r.op == REDIR_DUP){
+        if(strcmp(c, "-") == 0){
+            r.op = REDIR_CLOSE;
+        }
+        else{
+            char *end;
+            r.src = strtol(c, &end, 10);
+            if(*c == '\0' || *end != '\0'){
+                fprintf(stderr, "wsh: %s: bad file descriptor\n", c);
+                return -1;
+            }
+        }
+    }
+    else{
+        r.path = strdup(c);
+    }
+
+    p->redirs = (redirect *)realloc(p->redirs, (p->nredirs + 1) * sizeof(redirect));
+    p->redirs[p->nredirs++] = r;
+    return used;
+}
+
+/* Build the list of processes for a pipeline.  Stages are split on "|",
+   leading NAME=value words of a stage become its environment overrides.
+   Returns NULL if a stage has no command.  */
+process *create_process(char *command, char **args){
+    process *first_process = NULL;
+    process *last_process = NULL;
+    char *words[MAX_ARGS + 1];
+    int count = 0;
+
+    words[count++] = command;
+    for(int i = 0; args[i] != NULL && count < MAX_ARGS; i++){
+        words[count++] = args[i];
+    }
+    words[count] = NULL;
+
+    int start = 0;
+    while(start <= count){
+        int end = start;
+        while(end < count && strcmp(words[end], "|") != 0){
+            end++;
+        }
+        //skip over the VAR=x prefix of this stage
+        int cmd_start = start;
+        while(cmd_start < end && is_assignment(words[cmd_start])){
+            cmd_start++;
+        }
+
+        process *current_process = (process *)calloc(1, sizeof(process));
+        if(current_process == NULL){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        current_process->pidfd = -1;
+        if(cmd_start > start){
+            current_process->assigns = copy_words(words, start, cmd_start);
+        }
+
+        if(first_process == NULL){
+            first_process = current_process;
+        }
+        else{
+            last_process->next = current_process;
+        }
+        last_process = current_process;
+
+        //redirections can go anywhere, the rest is the command
+        char *argv_words[MAX_ARGS + 1];
+        int argc = 0;
+        for(int i = cmd_start; i < end; i++){
+            int used = parse_redirect(current_process, words[i], i + 1 < end ? words[i+1] : NULL);
+            if(used < 0){
+                free_processes(first_process);
+                return NULL;
+            }
+            if(used == 0){
+                argv_words[argc++] = words[i];
+            }
+            else{
+                i += used - 1;
+            }
+        }
+        current_process->argv = copy_words(argv_words, 0, argc);
+
+        if(argc == 0){
+            fprintf(stderr, "wsh: syntax error near '|'\n");
+            free_processes(first_process);
+            return NULL;
+        }
+        start = end + 1;
+    }
+
+    return first_process;
+}
+
+//give a new job an id and put it in the table, ready to launch
+void add_job(job *j, int is_bg){
+    job *comp_job = NULL;
+    j->next = NULL;
+    j->pgid = 0;
+    j->notified = 0;
+    j->capture_fd = -1;
+    j->output = NULL;
+    j->output_shown = 0;
+    j->launch_status = 0;
+    j->coproc_name = NULL;
+    j->coproc_in = -1;
+    j->coproc_out = -1;
+    j->owned = 0;
+    j->status_slot = -1;
+    j->completed_ns = 0;
+    j->journal_id = 0;
+    j->timeout_ns = 0;
+    j->timer_fd = -1;
+    j->timed_out = 0;
+    j->limits = NULL;
+    j->nlimits = 0;
+    j->cgroup_fd = -1;
+    j->curr_bg = is_bg;
+    j->waited = 0;
+    int need_id = 1;
+    int curr_id = 0;
+
+    //find the smallest id availible
+    if(first_job == NULL){
+        j->id = 1;
+    }
+    else{
+        while(need_id){
+            curr_id = curr_id + 1;
+            need_id = 0;    //assume that this run will find correct id
+            for (comp_job = first_job; comp_job; comp_job=comp_job->next){
+                if(comp_job->id == curr_id){
+                    need_id = 1; //found a match
+                }
+            }
+        }
+        j->id = curr_id;
+    }
+    //%N means this job now, not an old one that had the id
+    if(is_bg){
+        forget_done_job(j->id);
+    }
+
+    //initialize stdin, stdout, stderr
+    j->stdin = job_stdin;
+    j->stdout = job_stdout;
+    j->stderr = job_stderr;
+
+    //add it to the table before launching so its children can be found
+    if(first_job == NULL){
+        first_job = j;
+    }
+    else{
+        current_job->next = j;
+    }
+    current_job = j;
+}
+
+job *create_job(char *command, char ** args, int is_bg){
+    job *j = (job *)malloc(sizeof(job));
+    //keep the whole line for jobs to show
+    size_t len = strlen(command) + 1;
+    for(int i = 0; args[i] != NULL; i++){
+        len += strlen(args[i]) + 1;
+    }
+    j->command = (char *)malloc(len + 2);
+    strcpy(j->command, command);
+    for(int i = 0; args[i] != NULL; i++){
+        strcat(j->command, " ");
+        strcat(j->command, args[i]);
+    }
+    if(is_bg){
+        strcat(j->command, " &");
+    }
+    //parse the args in the create process func
+    j->first_process = create_process(command, args);
+    if(j->first_process == NULL){
+        free(j->command);
+        free(j);
+        return NULL;
+    }
+    add_job(j, is_bg);
+    launch_job(j);
+    return j;
+}
+
+//take a job out of the table and free it
+void remove_job(job *j){
+    job *prev = NULL;
+    job *comp_job;
+    for(comp_job = first_job; comp_job; comp_job = comp_job->next){
+        if(comp_job == j){
+            break;
+        }
+        prev = comp_job;
+    }
+    if(comp_job == NULL){
+        return;
+    }
+    if(prev){
+        prev->next = j->next;
+    }
+    else{
+        first_job = j->next;
+    }
+    if(current_job == j){
+        current_job = prev;
+    }
+    unpublish_job(j);
+    free_job(j);
+}
+
+//where did the foreground and 
+// void launch_process(process *p, pid_t pgid, int infile, int outfile, int errfile, int foreground){
+
+// }
+
+int change_dir(char *arg){
+    //TODO ARGS MIGHT NEED TO BE SHIFTED OVER ONE
+    //make sure  to have at least one parameter
+    if (arg == 0) { 
+        fprintf(stderr, "cd: Needs one more argument\n");
+        return 1; // Error
+    }
+    // Use chdir to change the current directory returns 0 on success
+    if (chdir(arg) != 0) {
+        fprintf(stderr, "cd: Unable to change to directory requested\n");
+        return 1; // Error
+    }
+    return 0; // Success
+}
+
+// int move_process(char* args[], int curr_fg){
+//     //check the correct amount of parameters are passed to it
+//     if(args[1] != NULL){
+//         fprintf(stderr, "move_process: Passed in too many parameters\n");
+//         return 1; //Error
+//     }
+//     //if no arg is passed through need tp use largest id
+//     if(args[0] == NULL){
+//         int largest_id = -1;
+//         for (int i = 0; i < 256; i++) {
+//             if (jobs[i].id > largest_id) {
+//                 largest_id = jobs[i].id;
+//             }
+//         }
+//         for(int i = 0; i < 256; i++){
+//             if(jobs[i].id == largest_id){
+//                 if(curr_fg){
+//                     tcsetpgrp(STDIN_FILENO, jobs[i].pid); //bring to the foreground
+//                 }
+//                 else{
+//                     kill(jobs[i].pid, SIGCONT);
+//                 }
+//                 return 0; //Success   
+//             }
+//         }
+//         //if finsishes loop = error did not find pid to bring to fg
+//     }
+//     //if arg is passed use that one
+//     else{
+//         //get the id from the arg
+//         int target_id = atoi(args[0]);
+//         for(int i = 0; i<256; i++){
+//             if(jobs[i].id == target_id){
+//                 if(curr_fg){
+//                     tcsetpgrp(STDIN_FILENO, jobs[i].pid); //bring to the foreground
+//                 }
+//                 else{
+//                     kill(jobs[i].pid, SIGCONT);
+//                 }
+//                 return 0; //Success found target id
+//             }
+//         }
+//         //might need an error statement here in case don't find id
+//     }
+//     return 1; //Should not reach this if found process 
+// }
+
+// void list_all_jobs(char* command, char* args[]){
+//     int size_of_args;
+//     int index = 0;
+//     printf("Background jobs:\n");
+//     for (int i=0; i<256; i++){
+//         if(jobs.id[i] != -1){
+//             while(args[index] != NULL){
+//                 index++;
+//             }
+//             //TODO: not sure if i can do this compare
+//             if(strcmp(args[index-1], "&") == 0){
+//                 //TODO: print the corret output with program and args then [&]
+//             }
+//             else{
+//                 //TODO: print same thing without ampersand
+//             }
+//             index = 0;      //reset it for the next job to find num of args
+//         }
+//     }
+// }
+
+
+//export NAME[=value]... marks the vars for the children's environment
+int export_vars(char *args[]){
+    for(int i = 0; args[i] != NULL; i++){
+        char *eq = strchr(args[i], '=');
+        if(eq != NULL){
+            *eq = '\0';
+            set_var(args[i], eq + 1, 1);
+            *eq = '=';
+        }
+        else{
+            set_var(args[i], NULL, 1);
+        }
+    }
+    return 0;
+}
+
+//find a job by its id, written as N or %N
+job *find_job_id(const char *arg){
+    job *j;
+    if(arg == NULL){
+        return NULL;
+    }
+    if(arg[0] == '%'){
+        arg++;
+    }
+    int id = atoi(arg);
+    for(j = first_job; j; j = j->next){
+        if(j->id == id){
+            return j;
+        }
+    }
+    return NULL;
+}
+
+//output %N [LINES]: print the captured output of a job, or its last LINES lines
+int show_output(char *args[]){
+    job *j = find_job_id(args[0]);
+    if(j == NULL){
+        fprintf(stderr, "output: no such job\n");
+        return 1;
+    }
+    j->output_shown = 1;
+    if(j->output == NULL){
+        return 0;
+    }
+    ring *r = j->output;
+    size_t start = 0;
+    if(args[1] != NULL){
+        //walk back over LINES newlines, a trailing one doesn't count
+        long lines = atol(args[1]);
+        size_t i = r->len;
+        if(i > 0 && ring_at(r, i - 1) == '\n'){
+            i--;
+        }
+        while(i > 0){
+            if(ring_at(r, i - 1) == '\n' && --lines <= 0){
+                break;
+            }
+            i--;
+        }
+        start = i;
+    }
+    else if(r->dropped){
+        fprintf(stderr, "[%zu earlier bytes dropped]\n", r->dropped);
+    }
+    fflush(stdout);
+    //the held bytes are at most two pieces of the ring
+    size_t first = (r->head + r->cap - r->len + start) % r->cap;
+    size_t n = r->len - start;
+    size_t piece = r->cap - first < n ? r->cap - first : n;
+    fwrite(r->data + first, 1, piece, stdout);
+    fwrite(r->data, 1, n - piece, stdout);
+    fflush(stdout);
+    return 0;
+}
+
+//a limit in the user's units
+char *format_limit(char *buf, size_t len, const rlimit_option *o, rlim_t value){
+    if(value == RLIM_INFINITY)
+        snprintf(buf, len, "unlimited");
+    else
+        snprintf(buf, len, "%llu", (unsigned long long)(value / o->scale));
+    return buf;
+}
+
+/* The limits ulimit gave job j as process p has them now, soft/hard.
+   A process that's gone shows what it was started with.  */
+void print_process_limits(job *j, process *p){
+    char line[256], soft[32], hard[32];
+    size_t used = 0;
+
+    for(int i = 0; i < j->nlimits; i++){
+        const rlimit_option *o = j->limits[i].option;
+        struct rlimit r;
+        int seen = 0;
+        for(int k = 0; k < i; k++)
+            seen |= j->limits[k].option == o;
+        if(seen)
+            continue;
+        if(p->completed || prlimit(p->pid, o->resource, NULL, &r) < 0){
+            getrlimit(o->resource, &r);
+            for(int k = i; k < j->nlimits; k++){
+                if(j->limits[k].option == o)
+                    change_limit(&j->limits[k], &r);
+            }
+        }
+        used += snprintf(line + used, sizeof(line) - used, "%s%s %s/%s", used ? ", " : "",
+                         o->name, format_limit(soft, sizeof(soft), o, r.rlim_cur),
+                         format_limit(hard, sizeof(hard), o, r.rlim_max));
+        if(used >= sizeof(line))
+            break;
+    }
+    if(used)
+        printf("             limits: %s\n", line);
+}
+
+/* jobs [-l] [-o N [LINES]]: list the jobs, or show a job's captured
+   output.  A job with a cgroup gets a line with what it used.  -l adds
+   a line per process, with its counters under set -o perf and the
+   limits ulimit gave the job.  */
+int list_all_jobs(char *args[]){
+    job *j;
+    int details = 0;
+    if(args[0] != NULL && strcmp(args[0], "-o") == 0){
+        return show_output(args + 1);
+    }
+    if(args[0] != NULL && strcmp(args[0], "-l") == 0){
+        details = 1;
+    }
+    update_status();
+    for(j = first_job; j; j = j->next){
+        const char *state = "Running";
+        if(job_is_completed(j)){
+            state = j->timed_out ? "Timeout" : "Done";
+        }
+        else if(job_is_stopped(j)){
+            state = "Stopped";
+        }
+        printf("[%d] %-8s %s%s\n", j->id, state, j->command,
+               j->output ? " (output captured)" : "");
+        print_cgroup_usage(j);
+        for(process *p = j->first_process; details && p; p = p->next){
+            char status[32] = "running";
+            if(p->completed)
+                snprintf(status, sizeof(status), "exit %d", process_exit_status(p));
+            else if(p->stopped)
+                strcpy(status, "stopped");
+            printf("      %-7d %-8s %s\n", (int)p->pid, status, p->argv[0]);
+            perf_print(stdout, "             ", p);
+            print_process_limits(j, p);
+        }
+    }
+    return 0;
+}
+
+//a ulimit value: a count in the option's unit, or unlimited
+int parse_limit(const char *arg, const rlimit_option *o, rlim_t *value){
+    char *end;
+    if(strcmp(arg, "unlimited") == 0){
+        *value = RLIM_INFINITY;
+        return 0;
+    }
+    if(arg[0] < '0' || arg[0] > '9')
+        return -1;
+    errno = 0;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if(errno != 0 || *end != '\0' || n > (RLIM_INFINITY - 1) / o->scale)
+        return -1;
+    *value = (rlim_t)n * o->scale;
+    return 0;
+}
+
+void print_limit(const rlimit_option *o, rlim_t value, int named){
+    char buf[32];
+    if(named){
+        char label[48];
+        snprintf(label, sizeof(label), "%s%s%s%s", o->name, o->unit[0] ? " (" : "",
+                 o->unit, o->unit[0] ? ")" : "");
+        printf("%-28s (-%c) %s\n", label, o->letter, format_limit(buf, sizeof(buf), o, value));
+    }
+    else{
+        printf("%s\n", format_limit(buf, sizeof(buf), o, value));
+    }
+}
+
+//cpu.max for a share of one cpu, N% or max
+int parse_cpu_max(const char *arg, char *out, size_t len){
+    char *end;
+    if(strcmp(arg, "max") == 0){
+        snprintf(out, len, "max");
+        return 0;
+    }
+    double percent = strtod(arg, &end);
+    if(end == arg || strcmp(end, "%") != 0 || percent <= 0 || percent > 100000)
+        return -1;
+    //quota per 100ms period, the kernel wants at least 1ms
+    long long quota = (long long)(percent * 1000);
+    snprintf(out, len, "%lld 100000", quota < 1000 ? 1000 : quota);
+    return 0;
+}
+
+//memory.max, bytes with an optional K, M or G, or max
+int parse_memory_max(const char *arg, char *out, size_t len){
+    char *end;
+    if(strcmp(arg, "max") == 0){
+        snprintf(out, len, "max");
+        return 0;
+    }
+    if(arg[0] < '0' || arg[0] > '9')
+        return -1;
+    errno = 0;
+    unsigned long long n = strtoull(arg, &end, 10);
+    int shift = 0;
+    if(*end == 'K' || *end == 'k')
+        shift = 10;
+    else if(*end == 'M' || *end == 'm')
+        shift = 20;
+    else if(*end == 'G' || *end == 'g')
+        shift = 30;
+    if(shift)
+        end++;
+    if(errno != 0 || *end != '\0' || n > (~0ULL >> (shift + 1)))
+        return -1;
+    snprintf(out, len, "%llu", n << shift);
+    return 0;
+}
+
+/* cgroup [-c PERCENT%|max] [-m BYTES[K|M|G]|max] [-j N] [cmd...]
+   With a command, run it in a cgroup of its own, set -o cgroup or not,
+   with cpu.max (a share of one cpu) and memory.max set.  -j N changes
+   them for job N while it runs.  Alone it says where the cgroups go.
+   Returns the status, *at is where the command starts, -1 if none.  */
+int cgroup_builtin(char *args[], int *at){
+    char cpu[32] = "", memory[32] = "";
+    job *target = NULL;
+    int i;
+
+    *at = -1;
+    for(i = 0; args[i] != NULL && args[i][0] == '-'; i += 2){
+        if(args[i+1] == NULL){
+            fprintf(stderr, "cgroup: %s: needs a value\n", args[i]);
+            return 1;
+        }
+        if(strcmp(args[i], "-c") == 0){
+            if(parse_cpu_max(args[i+1], cpu, sizeof(cpu)) < 0){
+                fprintf(stderr, "cgroup: %s: not a share of a cpu, like 50%%\n", args[i+1]);
+                return 1;
+            }
+        }
+        else if(strcmp(args[i], "-m") == 0){
+            if(parse_memory_max(args[i+1], memory, sizeof(memory)) < 0){
+                fprintf(stderr, "cgroup: %s: not a size\n", args[i+1]);
+                return 1;
+            }
+        }
+        else if(strcmp(args[i], "-j") == 0){
+            target = find_job_id(args[i+1]);
+            if(target == NULL){
+                fprintf(stderr, "cgroup: -j: no such job\n");
+                return 1;
+            }
+        }
+        else{
+            fprintf(stderr, "cgroup: usage: cgroup [-c PERCENT%%|max] [-m BYTES|max] [-j N] [cmd...]\n");
+            return 1;
+        }
+    }
+
+    if(target){
+        int status = 0;
+        if(args[i] != NULL){
+            fprintf(stderr, "cgroup: -j takes no command\n");
+            return 1;
+        }
+        if(target->cgroup_fd < 0){
+            fprintf(stderr, "cgroup: job %d has no cgroup\n", target->id);
+            return 1;
+        }
+        if(cpu[0] && set_cgroup_file(target->cgroup_fd, "cpu.max", cpu) < 0)
+            status = 1;
+        if(memory[0] && set_cgroup_file(target->cgroup_fd, "memory.max", memory) < 0)
+            status = 1;
+        return status;
+    }
+    if(args[i] != NULL){
+        next_cgroup = 1;
+        snprintf(next_cpu_max, sizeof(next_cpu_max), "%s", cpu);
+        snprintf(next_memory_max, sizeof(next_memory_max), "%s", memory);
+        *at = i;
+        return 0;
     }
+    if(cpu[0] || memory[0]){
+        fprintf(stderr, "cgroup: -c and -m need a command or -j\n");
+        return 1;
+    }
+    if(cgroup_root < 0 && open_cgroup_root() < 0)
+        return 1;
+    char controllers[256] = "";
+    int fd = openat(cgroup_root, "cgroup.subtree_control", O_RDONLY | O_CLOEXEC);
+    if(fd >= 0){
+        ssize_t n = read(fd, controllers, sizeof(controllers) - 1);
+        controllers[n > 0 ? n : 0] = '\0';
+        controllers[strcspn(controllers, "\n")] = '\0';
+        close(fd);
+    }
+    printf("%s, jobs %s, controllers: %s\n", cgroup_path,
+           cgroup_on ? "each get a cgroup" : "get one with cgroup cmd...",
+           controllers[0] ? controllers : "none");
+    return 0;
+}
 
-  /* Set the standard input/output channels of the new process.  */
-  if (infile != STDIN_FILENO)
-    {
-      dup2 (infile, STDIN_FILENO);
-      close (infile);
+/* ulimit [-H|-S] [-a] [-j N] [-RES [VALUE]]... [cmd...]
+   Without a command it shows or sets the shell's limits, which every
+   later command inherits; -S/-H pick the soft or hard limit, setting
+   without either sets both.  With a command the limits are only that
+   job's.  -j N shows or changes the limits of the live processes of
+   job N instead, with prlimit.  Returns the status, *at is where the
+   command starts, -1 if there is none.  */
+int ulimit_builtin(char *args[], int *at){
+    job_limit limits[32];
+    const rlimit_option *shown[32];
+    int nlimits = 0, nshown = 0;
+    char which = 0;
+    job *target = NULL;
+    int i;
+
+    *at = -1;
+    for(i = 0; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++){
+        if(strcmp(args[i], "-j") == 0){
+            target = find_job_id(args[i+1]);
+            if(target == NULL){
+                fprintf(stderr, "ulimit: -j: no such job\n");
+                return 1;
+            }
+            i++;
+            continue;
+        }
+        for(char *c = args[i] + 1; *c; c++){
+            if(*c == 'H' || *c == 'S'){
+                which = *c;
+                continue;
+            }
+            if(*c == 'a'){
+                for(rlimit_option *o = rlimit_options; o->letter && nshown < 32; o++)
+                    shown[nshown++] = o;
+                continue;
+            }
+            rlimit_option *o = rlimit_options;
+            while(o->letter && o->letter != *c)
+                o++;
+            if(o->letter == 0){
+                fprintf(stderr, "ulimit: -%c: invalid option\n", *c);
+                fprintf(stderr, "ulimit: usage: ulimit [-H|-S] [-a] [-j N] [-cdflmnstuv [VALUE]]... [cmd...]\n");
+                return 1;
+            }
+            //the value belongs to the last letter
+            rlim_t value;
+            if(c[1] == '\0' && args[i+1] != NULL && parse_limit(args[i+1], o, &value) == 0){
+                if(nlimits == 32){
+                    fprintf(stderr, "ulimit: too many limits\n");
+                    return 1;
+                }
+                limits[nlimits].option = o;
+                limits[nlimits].which = which;
+                limits[nlimits].value = value;
+                nlimits++;
+                i++;
+            }
+            else if(nshown < 32){
+                shown[nshown++] = o;
+            }
+        }
     }
-  if (outfile != STDOUT_FILENO)
-    {
-      dup2 (outfile, STDOUT_FILENO);
-      close (outfile);
+    if(nlimits == 0 && nshown == 0){
+        shown[nshown++] = &rlimit_options[2];   //-f, as in bash
     }
-  if (errfile != STDERR_FILENO)
-    {
-      dup2 (errfile, STDERR_FILENO);
-      close (errfile);
+
+    if(args[i] != NULL){
+        if(target || (nshown && nlimits == 0)){
+            fprintf(stderr, "ulimit: %s: invalid limit\n", args[i]);
+            return 1;
+        }
+        next_limits = (job_limit *)malloc(nlimits * sizeof(job_limit));
+        memcpy(next_limits, limits, nlimits * sizeof(job_limit));
+        next_nlimits = nlimits;
+        *at = i;
+        return 0;
+    }
+
+    if(target){
+        int status = 0;
+        for(process *p = target->first_process; p; p = p->next){
+            if(p->completed || p->pid <= 0)
+                continue;
+            for(int k = 0; k < nlimits; k++){
+                struct rlimit r;
+                if(prlimit(p->pid, limits[k].option->resource, NULL, &r) < 0){
+                    fprintf(stderr, "ulimit: %d: %s\n", (int)p->pid, strerror(errno));
+                    status = 1;
+                    break;
+                }
+                change_limit(&limits[k], &r);
+                if(prlimit(p->pid, limits[k].option->resource, &r, NULL) < 0){
+                    fprintf(stderr, "ulimit: %d: -%c: %s\n", (int)p->pid,
+                            limits[k].option->letter, strerror(errno));
+                    status = 1;
+                }
+            }
+            for(int k = 0; k < nshown; k++){
+                struct rlimit r;
+                if(prlimit(p->pid, shown[k]->resource, NULL, &r) < 0){
+                    fprintf(stderr, "ulimit: %d: %s\n", (int)p->pid, strerror(errno));
+                    status = 1;
+                    break;
+                }
+                printf("%-7d ", (int)p->pid);
+                print_limit(shown[k], which == 'H' ? r.rlim_max : r.rlim_cur, 1);
+            }
+        }
+        //jobs -l shows the job's limits, the changed ones are among them now
+        if(nlimits){
+            target->limits = (job_limit *)realloc(target->limits,
+                                                  (target->nlimits + nlimits) * sizeof(job_limit));
+            memcpy(target->limits + target->nlimits, limits, nlimits * sizeof(job_limit));
+            target->nlimits += nlimits;
+        }
+        return status;
     }
 
-  /* 
-  ec the new process.  Make sure we exit.  */
-  execvp (curr_path, p->argv);
-  perror ("execvp");
-  exit (1);
+    int status = 0, err;
+    if(nlimits && (err = apply_limits(limits, nlimits)) != 0){
+        fprintf(stderr, "ulimit: %s\n", strerror(err));
+        status = 1;
+    }
+    for(int k = 0; k < nshown; k++){
+        struct rlimit r;
+        getrlimit(shown[k]->resource, &r);
+        print_limit(shown[k], which == 'H' ? r.rlim_max : r.rlim_cur, nshown > 1);
+    }
+    return status;
 }
 
-char *get_path(process *p){
-    char path_usr[256] = "/usr/bin";
-    char path[256] = "/bin";
-    char *curr_path = (char *)malloc(256);
+//forkstat: the shell's resident size, what forking it costs and how fast pipelines start
+int fork_stats(void){
+    long size, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
 
-    if (curr_path == NULL) {
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
+    if(statm){
+        if(fscanf(statm, "%ld %ld", &size, &resident) != 2)
+            resident = 0;
+        fclose(statm);
+    }
+    printf("rss %ld KiB, %zu KiB kept out of children\n",
+           resident * (sysconf(_SC_PAGESIZE) / 1024), shell_mapped / 1024);
+    printf("forks %lld, last %lld us, mean %lld us, max %lld us\n", fork_count,
+           fork_ns_last / 1000, fork_count ? fork_ns_total / fork_count / 1000 : 0,
+           fork_ns_max / 1000);
+    printf("vfork spawns %lld, last pipeline %d stages started in %lld us%s\n", vfork_count,
+           pipeline_stages_last, pipeline_ns_last / 1000,
+           pipeline_concurrent_last ? " (concurrent)" : "");
+    if(first_byte_ns_last >= 0)
+        printf("first captured byte %lld us after launch (only captured jobs are timed)\n",
+               first_byte_ns_last / 1000);
+    return 0;
+}
+
+//a duration for people, in the unit that suits it
+char *format_ns(char *buf, size_t len, unsigned long long ns){
+    if(ns < 10000)
+        snprintf(buf, len, "%lluns", ns);
+    else if(ns < 10000000)
+        snprintf(buf, len, "%lluus", ns / 1000);
+    else if(ns < 10000000000ULL)
+        snprintf(buf, len, "%llums", ns / 1000000);
+    else
+        snprintf(buf, len, "%.1fs", ns / 1e9);
+    return buf;
+}
+
+void print_histogram(const char *name, histogram *h){
+    char mean[16], p50[16], p90[16], p99[16], max[16];
+    if(h->count == 0){
+        printf("%-18s none yet\n", name);
+        return;
+    }
+    printf("%-18s %llu, mean %s  p50 %s  p90 %s  p99 %s  max %s\n", name, h->count,
+           format_ns(mean, sizeof(mean), h->sum / h->count),
+           format_ns(p50, sizeof(p50), hist_percentile(h, 0.5)),
+           format_ns(p90, sizeof(p90), hist_percentile(h, 0.9)),
+           format_ns(p99, sizeof(p99), hist_percentile(h, 0.99)),
+           format_ns(max, sizeof(max), h->max));
+}
+
+//the histogram as a JSON object, only the buckets in use
+void print_histogram_json(const char *name, histogram *h){
+    int first = 1;
+    printf("  \"%s\": {\"count\": %llu, \"sum_ns\": %llu, \"max_ns\": %llu, "
+           "\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"buckets\": [",
+           name, h->count, h->sum, h->max, hist_percentile(h, 0.5),
+           hist_percentile(h, 0.9), hist_percentile(h, 0.99));
+    for(int i = 0; i < HIST_BUCKETS; i++){
+        if(h->buckets[i] == 0)
+            continue;
+        printf("%s[%llu, %llu]", first ? "" : ", ", hist_lower(i), h->buckets[i]);
+        first = 0;
+    }
+    printf("]}");
+}
+
+/* stats [--json | --reset]: the shell's counters and latency
+   histograms.  Buckets in the JSON are [lowest ns, count].  */
+int show_stats(char *args[]){
+    if(args[0] != NULL && strcmp(args[0], "--reset") == 0){
+        memset(&stats, 0, sizeof(stats));
+        fork_count = fork_ns_total = fork_ns_last = fork_ns_max = 0;
+        vfork_count = 0;
+        return 0;
     }
+    if(args[0] != NULL && strcmp(args[0], "--json") == 0){
+        printf("{\n  \"forks\": %lld,\n  \"vfork_spawns\": %lld,\n  \"execs\": %llu,\n"
+               "  \"exec_failures\": %llu,\n  \"path_cache_hits\": %llu,\n"
+               "  \"path_cache_misses\": %llu,\n  \"jobs_launched\": %llu,\n"
+               "  \"jobs_reaped\": %llu,\n",
+               fork_count, vfork_count, stats.execs, stats.exec_failures, stats.path_hits,
+               stats.path_misses, stats.jobs_launched, stats.jobs_reaped);
+        print_histogram_json("spawn", &stats.spawn);
+        printf(",\n");
+        print_histogram_json("exec_to_reap", &stats.exec_reap);
+        printf(",\n");
+        print_histogram_json("notification_lag", &stats.notify);
+        printf("\n}\n");
+        return 0;
+    }
+    if(args[0] != NULL){
+        fprintf(stderr, "stats: usage: stats [--json | --reset]\n");
+        return 2;
+    }
+    printf("%-18s %lld, %lld vfork spawns\n", "forks", fork_count, vfork_count);
+    printf("%-18s %llu, %llu failed\n", "execs", stats.execs, stats.exec_failures);
+    printf("%-18s %llu hits, %llu misses\n", "path cache", stats.path_hits, stats.path_misses);
+    printf("%-18s %llu launched, %llu reaped\n", "jobs", stats.jobs_launched, stats.jobs_reaped);
+    print_histogram("spawn", &stats.spawn);
+    print_histogram("exec to reap", &stats.exec_reap);
+    print_histogram("notification lag", &stats.notify);
+    return 0;
+}
 
-    strcat(path_usr, p->argv[0]);
-    strcat(path, p->argv[0]);
+//a polled pidfd is readable once its process exited, reap it
+void pidfd_ready(int fd, void *data){
+    update_status();
+}
+
+//milliseconds on the monotonic clock
+long long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* wait [-n] [-t SECONDS] [%N...]: wait for the given jobs, or every
+   background job, to finish.  -n returns as soon as one of them does.
+   Each unfinished process gets a pidfd that is polled along with the
+   shell's other fds, so captured output keeps draining while we wait.
+   Returns the status of the last job that finished, 124 on timeout
+   and 127 for an unknown job.  A job that finished and was reported
+   before wait got to it still gives its status, once.  */
+int wait_jobs(char *args[]){
+    job **targets;
+    int count = 0;
+    int any = 0;
+    long long deadline = -1;
+    int status = 0;
+    int i = 0;
 
-    if(access(path_usr, X_OK) != 0){
-        if(access(path, X_OK) != 0){
-            char not_found[256] = "Command was not found\n";
-            write(STDOUT_FILENO, not_found, strlen(not_found));
-            free(curr_path);
-            return "0";
+    for(; args[i] != NULL && args[i][0] == '-'; i++){
+        if(strcmp(args[i], "-n") == 0){
+            any = 1;
+        }
+        else if(strcmp(args[i], "-t") == 0 && args[i+1] != NULL){
+            deadline = now_ms() + (long long)(atof(args[++i]) * 1000);
         }
         else{
-            strcpy(curr_path, path);
+            fprintf(stderr, "wait: usage: wait [-n] [-t SECONDS] [%%N...]\n");
+            return 2;
+        }
+    }
+    int max = 0;
+    for(job *j = first_job; j; j = j->next){
+        max++;
+    }
+    for(int k = i; args[k] != NULL; k++){
+        max++;
+    }
+    targets = (job **)malloc((max + 1) * sizeof(job *));
+    if(args[i] == NULL){
+        for(job *j = first_job; j; j = j->next){
+            if(j->curr_bg && !job_is_stopped(j)){
+                targets[count++] = j;
+            }
+        }
+    }
+    for(; args[i] != NULL; i++){
+        job *j = find_job_id(args[i]);
+        if(j == NULL){
+            //finished and reported already, but nobody waited for it
+            int done = forget_done_job(atoi(args[i][0] == '%' ? args[i] + 1 : args[i]));
+            if(done >= 0){
+                status = done;
+                continue;
+            }
+            fprintf(stderr, "wait: %s: no such job\n", args[i]);
+            free(targets);
+            return 127;
+        }
+        targets[count++] = j;
+    }
+
+    update_status();
+    while(1){
+        int finished = 0;
+        for(int t = 0; t < count; t++){
+            job *j = targets[t];
+            if(job_is_stopped(j)){
+                finished++;
+                if(job_is_completed(j) && !j->waited){
+                    j->waited = 1;
+                    status = job_exit_status(j);
+                }
+                if(j->notified == 0 && job_is_completed(j)){
+                    //wait already told the caller, no need to announce it
+                    j->notified = 1;
+                    perf_report(j);
+                    notified_job(j);
+                }
+            }
+            for(process *p = j->first_process; p; p = p->next){
+                if(p->completed || p->stopped){
+                    if(p->pidfd >= 0){
+                        remove_watch(p->pidfd);
+                        close(p->pidfd);
+                        p->pidfd = -1;
+                    }
+                }
+                else if(p->pidfd < 0 && p->pid > 0){
+                    p->pidfd = syscall(SYS_pidfd_open, p->pid, 0);
+                    if(p->pidfd >= 0){
+                        fcntl(p->pidfd, F_SETFD, FD_CLOEXEC);
+                        add_watch(p->pidfd, pidfd_ready, p);
+                    }
+                }
+            }
+        }
+        if(finished == count || (any && finished > 0)){
+            break;
+        }
+        int timeout = -1;
+        if(deadline >= 0){
+            long long left = deadline - now_ms();
+            if(left <= 0){
+                status = 124;
+                break;
+            }
+            timeout = (int)left;
+        }
+        run_events(-1, timeout);
+    }
+
+    //pidfds only live while we wait
+    for(int t = 0; t < count; t++){
+        for(process *p = targets[t]->first_process; p; p = p->next){
+            if(p->pidfd >= 0){
+                remove_watch(p->pidfd);
+                close(p->pidfd);
+                p->pidfd = -1;
+            }
+        }
+    }
+    free(targets);
+    return status;
+}
+
+#define MAX_ARG_STRLEN (32 * 4096)  //the kernel's cap on one argv string
+
+/* State of one batch builtin run: the argv being packed and the jobs
+   still running.  */
+typedef struct batcher{
+    char **argv;        //command words, then the packed items
+    int fixed;          //how many argv slots are the command itself
+    int count;          //argv slots used
+    int cap;
+    long size;          //bytes the items will take in the exec
+    long limit;         //what ARG_MAX leaves for the items
+    int max_items;      //-n, 0 for no limit
+    job **running;
+    int parallel;       //-P
+    int nrunning;
+    int stdin_fd;       //what the batches read, never the item stream
+    int status;
+} batcher;
+
+//collect finished batches, waiting for one if wait_one is set
+void reap_batches(batcher *b, int wait_one){
+    update_status();
+    while(1){
+        int reaped = 0;
+        for(int i = 0; i < b->nrunning; i++){
+            job *j = b->running[i];
+            if(!job_is_completed(j))
+                continue;
+            int st = job_exit_status(j);
+            //like xargs: 123 if any batch failed, but can't-run wins
+            if(j->launch_status)
+                b->status = j->launch_status;
+            else if(st != 0 && b->status == 0)
+                b->status = 123;
+            remove_job(j);
+            b->running[i--] = b->running[--b->nrunning];
+            reaped++;
+        }
+        if(reaped || !wait_one || b->nrunning == 0)
+            return;
+        run_events(-1, -1);
+    }
+}
+
+//launch the packed items as one job, after a free slot opens up
+void flush_batch(batcher *b){
+    if(b->count == b->fixed)
+        return;
+    while(b->nrunning >= b->parallel)
+        reap_batches(b, 1);
+    //no point trying again once cmd couldn't be run
+    if(b->status >= 126){
+        for(int i = b->fixed; i < b->count; i++)
+            free(b->argv[i]);
+        b->count = b->fixed;
+        b->size = 0;
+        return;
+    }
+
+    process *p = (process *)calloc(1, sizeof(process));
+    p->pidfd = -1;
+    p->argv = (char **)malloc((b->count + 1) * sizeof(char *));
+    for(int i = 0; i < b->count; i++){
+        p->argv[i] = i < b->fixed ? strdup(b->argv[i]) : b->argv[i];
+    }
+    p->argv[b->count] = NULL;
+
+    //the job list shows the command, not a million names
+    job *j = (job *)malloc(sizeof(job));
+    size_t len = 64;
+    for(int i = 0; i < b->fixed; i++)
+        len += strlen(b->argv[i]) + 1;
+    j->command = (char *)malloc(len);
+    j->command[0] = '\0';
+    for(int i = 0; i < b->fixed; i++){
+        strcat(j->command, b->argv[i]);
+        strcat(j->command, " ");
+    }
+    sprintf(j->command + strlen(j->command), "(+%d items)", b->count - b->fixed);
+    j->first_process = p;
+    add_job(j, 1);
+    j->owned = 1;
+    j->stdin = b->stdin_fd;
+    launch_job(j);
+
+    b->running[b->nrunning++] = j;
+    b->count = b->fixed;
+    b->size = 0;
+}
+
+void batch_item(batcher *b, const char *item, size_t len){
+    long cost = len + 1 + sizeof(char *);
+    if(cost > b->limit || len >= MAX_ARG_STRLEN){
+        fprintf(stderr, "batch: argument too long, skipped\n");
+        if(b->status == 0)
+            b->status = 1;
+        return;
+    }
+    if(b->size + cost > b->limit || (b->max_items && b->count - b->fixed == b->max_items))
+        flush_batch(b);
+    if(b->count == b->cap){
+        b->cap *= 2;
+        b->argv = (char **)realloc(b->argv, b->cap * sizeof(char *));
+    }
+    b->argv[b->count++] = strndup(item, len);
+    b->size += cost;
+}
+
+/* batch [-P N] [-n MAX] [-0] [-g PATTERN]... cmd [args...]
+
+   An xargs built into the shell: items come from the -g globs, or from
+   stdin one per line (NUL separated with -0), and are packed onto cmd's
+   argv as far as ARG_MAX allows once the environment and the command
+   itself are paid for.  Up to -P batches run at once as jobs.  Returns
+   0, 123 if any batch failed, or 126/127 if cmd couldn't be run.  */
+int run_batches(char *args[]){
+    batcher b;
+    char sep = '\n';
+    char *globs[64];
+    int nglobs = 0;
+    int i = 0;
+
+    memset(&b, 0, sizeof(b));
+    b.parallel = 1;
+    for(; args[i] != NULL && args[i][0] == '-'; i++){
+        if(strcmp(args[i], "-0") == 0)
+            sep = '\0';
+        else if(strcmp(args[i], "-P") == 0 && args[i+1])
+            b.parallel = atoi(args[++i]);
+        else if(strcmp(args[i], "-n") == 0 && args[i+1])
+            b.max_items = atoi(args[++i]);
+        else if(strcmp(args[i], "-g") == 0 && args[i+1] && nglobs < 64)
+            globs[nglobs++] = args[++i];
+        else
+            break;
+    }
+    if(args[i] == NULL || b.parallel < 1 || b.max_items < 0){
+        fprintf(stderr, "batch: usage: batch [-P N] [-n MAX] [-0] [-g PATTERN]... command [args...]\n");
+        return 2;
+    }
+
+    //what's left of ARG_MAX after the environment and the command words,
+    //less the same 2k of headroom POSIX xargs keeps
+    b.limit = sysconf(_SC_ARG_MAX) - 2048;
+    for(char **e = get_envp(); *e; e++)
+        b.limit -= strlen(*e) + 1 + sizeof(char *);
+    b.cap = 64;
+    b.argv = (char **)malloc(b.cap * sizeof(char *));
+    for(; args[i] != NULL; i++){
+        if(b.count == b.cap){
+            b.cap *= 2;
+            b.argv = (char **)realloc(b.argv, b.cap * sizeof(char *));
+        }
+        b.argv[b.count++] = args[i];
+        b.limit -= strlen(args[i]) + 1 + sizeof(char *);
+    }
+    b.fixed = b.count;
+    b.running = (job **)malloc(b.parallel * sizeof(job *));
+    b.stdin_fd = job_stdin;
+
+    if(nglobs > 0){
+        for(int g = 0; g < nglobs; g++){
+            glob_list gl = {NULL, 0, 0};
+            glob_match_all(globs[g], &gl);
+            for(int k = 0; k < gl.count; k++){
+                batch_item(&b, gl.paths[k], strlen(gl.paths[k]));
+                free(gl.paths[k]);
+            }
+            free(gl.paths);
         }
     }
     else{
-        strcpy(curr_path, path_usr);
+        //the batches must not eat the rest of the item stream
+        b.stdin_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        char chunk[65536];
+        char *item = NULL;
+        size_t item_len = 0, item_cap = 0;
+        ssize_t n;
+        while((n = read(job_stdin, chunk, sizeof(chunk))) != 0){
+            if(n < 0){
+                if(errno == EINTR)
+                    continue;
+                perror("batch: read");
+                break;
+            }
+            for(ssize_t k = 0; k < n; k++){
+                if(chunk[k] == sep){
+                    if(item_len > 0)
+                        batch_item(&b, item, item_len);
+                    item_len = 0;
+                    continue;
+                }
+                if(item_len == item_cap){
+                    item_cap = item_cap ? item_cap * 2 : 256;
+                    item = (char *)realloc(item, item_cap);
+                }
+                item[item_len++] = chunk[k];
+            }
+            //keep the finished batches from piling up while we read
+            reap_batches(&b, 0);
+        }
+        if(item_len > 0)
+            batch_item(&b, item, item_len);
+        free(item);
+    }
+
+    flush_batch(&b);
+    while(b.nrunning > 0)
+        reap_batches(&b, 1);
+    if(b.stdin_fd != job_stdin)
+        close(b.stdin_fd);
+    for(int k = b.fixed; k < b.count; k++)
+        free(b.argv[k]);
+    free(b.argv);
+    free(b.running);
+    return b.status;
+}
+
+/* batch is a stage builtin, so seq 5 | batch echo reads the pipeline.
+   A subshell made from the stage's child runs it, the batches are that
+   subshell's jobs.  */
+int batch_stage(char **argv, char **envp){
+    (void)envp;
+    become_subshell();
+    return run_batches(argv + 1);
+}
+
+/* memo: results of deterministic commands, kept on disk.  An entry is
+   named after a hash of everything that went into the run and holds
+   the exit status, the stdout and then the stderr.  Entries are touched
+   on every hit.  On a shell's first store, and again each time it has
+   stored another sixteenth of WSH_MEMO_SIZE, the directory is scanned
+   and the least recently used go until it fits.  */
+#define MEMO_MAGIC 0x4f4d454d       //"MEMO"
+#define MEMO_SIZE (64 << 20)        //default size limit of the memo dir
+
+typedef struct memo_header{
+    unsigned int magic;
+    int status;
+    long long out_len;
+    long long err_len;
+} memo_header;
+
+typedef unsigned __int128 memo_key;
+
+long long memo_stored = -1; //bytes stored since the last eviction scan, -1 before the first
+
+//128 bit FNV-1a
+void memo_hash(memo_key *h, const void *data, size_t len){
+    const memo_key prime = ((memo_key)1 << 88) + 0x13b;
+    const unsigned char *c = (const unsigned char *)data;
+    for(size_t i = 0; i < len; i++){
+        *h ^= c[i];
+        *h *= prime;
+    }
+}
+
+//hash one field, "ab" "c" mustn't hash like "a" "bc"
+void memo_hash_field(memo_key *h, const void *data, size_t len){
+    memo_hash(h, data, len);
+    memo_hash(h, "", 1);
+}
+
+void memo_dir(char *out, size_t len){
+    char *dir = get_var("WSH_MEMO_DIR");
+    char *home = get_var("HOME");
+    if(dir != NULL)
+        snprintf(out, len, "%s", dir);
+    else
+        snprintf(out, len, "%s/.wsh_memo", home ? home : "/tmp");
+}
+
+typedef struct memo_file{
+    char name[64];
+    long long size;
+    struct timespec used;
+} memo_file;
+
+int memo_file_cmp(const void *a, const void *b){
+    const memo_file *x = (const memo_file *)a, *y = (const memo_file *)b;
+    if(x->used.tv_sec != y->used.tv_sec)
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    return x->used.tv_nsec < y->used.tv_nsec ? -1 : x->used.tv_nsec > y->used.tv_nsec;
+}
+
+//remove the least recently used entries until dir fits in limit
+void memo_evict(const char *dir, long long limit){
+    memo_file *files = NULL;
+    int count = 0, cap = 0;
+    long long total = 0;
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    struct stat st;
+
+    if(d == NULL)
+        return;
+    while((e = readdir(d)) != NULL){
+        if(e->d_name[0] == '.' || strlen(e->d_name) >= 64)
+            continue;
+        if(fstatat(dirfd(d), e->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))
+            continue;
+        if(count == cap){
+            cap = cap ? cap * 2 : 64;
+            files = (memo_file *)realloc(files, cap * sizeof(memo_file));
+        }
+        strcpy(files[count].name, e->d_name);
+        files[count].size = st.st_size;
+        files[count].used = st.st_mtim;
+        total += st.st_size;
+        count++;
+    }
+    if(total > limit)
+        qsort(files, count, sizeof(memo_file), memo_file_cmp);
+    for(int i = 0; i < count && total > limit; i++){
+        unlinkat(dirfd(d), files[i].name, 0);
+        total -= files[i].size;
+    }
+    closedir(d);
+    free(files);
+}
+
+/* memo [-i FILE]... [-I FILE]... [-e VAR]... cmd [args...]
+
+   Runs cmd, or replays what it printed last time if nothing it depends
+   on changed.  The key covers the words, the working directory, the
+   named env vars, -i files by size, mtime and inode, and -I files by a
+   hash of their contents.  cmd's stdin isn't part of the key, so only
+   memoize commands that don't read it.  A miss runs the job with its
+   stdout and stderr going to files, then replays those, so output only
+   shows up once it's done.  Runs that didn't exit normally aren't kept.  */
+int memo_run(char *args[]){
+    memo_key h = ((memo_key)0x6c62272e07bb0142ull << 64) | 0x62b821756295c58dull;
+    char dir[4096], entry[4200], tmp[3][4200];
+    char cwd[4096];
+    struct stat st;
+    int i = 0;
+
+    for(; args[i] != NULL && args[i][0] == '-' && args[i+1] != NULL; i += 2){
+        char *opt = args[i], *arg = args[i+1];
+        if(strcmp(opt, "-e") == 0){
+            char *value = get_var(arg);
+            memo_hash_field(&h, arg, strlen(arg));
+            memo_hash_field(&h, value ? value : "", value ? strlen(value) + 1 : 0);
+        }
+        else if(strcmp(opt, "-i") == 0 || strcmp(opt, "-I") == 0){
+            memo_hash_field(&h, arg, strlen(arg));
+            if(stat(arg, &st) < 0){
+                fprintf(stderr, "memo: %s: %s\n", arg, strerror(errno));
+                return 1;
+            }
+            if(opt[1] == 'i'){
+                long long id[5] = { st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+                                    (long long)st.st_ino, (long long)st.st_dev };
+                memo_hash_field(&h, id, sizeof(id));
+                continue;
+            }
+            int fd = open(arg, O_RDONLY | O_CLOEXEC);
+            char *map = (fd >= 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+                        ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+            if(fd < 0 || map == MAP_FAILED){
+                fprintf(stderr, "memo: %s: %s\n", arg, strerror(errno));
+                if(fd >= 0)
+                    close(fd);
+                return 1;
+            }
+            if(map){
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                memo_hash(&h, map, st.st_size);
+                munmap(map, st.st_size);
+            }
+            else{
+                //proc and sysfs files say size 0 but have contents
+                char buf[65536];
+                ssize_t n;
+                while((n = read(fd, buf, sizeof(buf))) != 0){
+                    if(n < 0 && errno == EINTR)
+                        continue;
+                    if(n < 0){
+                        fprintf(stderr, "memo: %s: %s\n", arg, strerror(errno));
+                        close(fd);
+                        return 1;
+                    }
+                    memo_hash(&h, buf, n);
+                }
+            }
+            memo_hash(&h, "", 1);
+            close(fd);
+        }
+        else{
+            break;
+        }
+    }
+    if(args[i] == NULL || args[i][0] == '-'){
+        fprintf(stderr, "memo: usage: memo [-i FILE]... [-I FILE]... [-e VAR]... command [args...]\n");
+        return 2;
+    }
+    if(getcwd(cwd, sizeof(cwd)) == NULL)
+        cwd[0] = '\0';
+    memo_hash_field(&h, cwd, strlen(cwd));
+    for(int k = i; args[k] != NULL; k++)
+        memo_hash_field(&h, args[k], strlen(args[k]));
+
+    memo_dir(dir, sizeof(dir));
+    mkdir(dir, 0700);
+    snprintf(entry, sizeof(entry), "%s/%016llx%016llx", dir,
+             (unsigned long long)(h >> 64), (unsigned long long)h);
+
+    //a hit: replay it and mark it used
+    memo_header hdr;
+    int fd = open(entry, O_RDONLY | O_CLOEXEC);
+    if(fd >= 0){
+        if(fstat(fd, &st) == 0 && read(fd, &hdr, sizeof(hdr)) == sizeof(hdr)
+           && hdr.magic == MEMO_MAGIC && hdr.out_len >= 0 && hdr.err_len >= 0
+           && (long long)sizeof(hdr) + hdr.out_len + hdr.err_len == st.st_size){
+            fflush(stdout);
+            copy_fd(fd, job_stdout, hdr.out_len);
+            copy_fd(fd, job_stderr, hdr.err_len);
+            futimens(fd, NULL);
+            close(fd);
+            return hdr.status;
+        }
+        close(fd);
+    }
+
+    //a miss: run it with stdout and stderr going to files
+    int out_fd, err_fd, entry_fd;
+    for(int k = 0; k < 3; k++)
+        snprintf(tmp[k], sizeof(tmp[k]), "%s/.tmp.%d.%d", dir, (int)getpid(), k);
+    out_fd = open(tmp[0], O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    err_fd = open(tmp[1], O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    unlink(tmp[0]);
+    unlink(tmp[1]);
+    if(out_fd < 0 || err_fd < 0){
+        fprintf(stderr, "memo: %s: %s\n", dir, strerror(errno));
+        if(out_fd >= 0)
+            close(out_fd);
+        if(err_fd >= 0)
+            close(err_fd);
+        return 1;
+    }
+
+    int saved_out = job_stdout, saved_err = job_stderr;
+    job_stdout = out_fd;
+    job_stderr = err_fd;
+    job *j = create_job(args[i], args + i + 1, 0);
+    job_stdout = saved_out;
+    job_stderr = saved_err;
+    int status = 2;
+    int keep = 0;
+    //a stopped job stays in the table and isn't kept
+    if(j != NULL && job_is_completed(j)){
+        status = job_exit_status(j);
+        set_pipestatus(j);
+        keep = j->launch_status == 0;
+        for(process *p = j->first_process; p; p = p->next){
+            if(!WIFEXITED(p->status))
+                keep = 0;
+        }
+        remove_job(j);
+    }
+
+    hdr.magic = MEMO_MAGIC;
+    hdr.status = status;
+    hdr.out_len = lseek(out_fd, 0, SEEK_END);
+    hdr.err_len = lseek(err_fd, 0, SEEK_END);
+    lseek(out_fd, 0, SEEK_SET);
+    lseek(err_fd, 0, SEEK_SET);
+    fflush(stdout);
+    copy_fd(out_fd, job_stdout, -1);
+    copy_fd(err_fd, job_stderr, -1);
+
+    //written aside and renamed in, another shell may be replaying it
+    if(keep && (entry_fd = open(tmp[2], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) >= 0){
+        lseek(out_fd, 0, SEEK_SET);
+        lseek(err_fd, 0, SEEK_SET);
+        if(write_all(entry_fd, (char *)&hdr, sizeof(hdr)) == 0
+           && copy_fd(out_fd, entry_fd, -1) == 0 && copy_fd(err_fd, entry_fd, -1) == 0){
+            rename(tmp[2], entry);
+        }
+        else{
+            unlink(tmp[2]);
+        }
+        close(entry_fd);
+        char *size = get_var("WSH_MEMO_SIZE");
+        long long limit = size && atoll(size) > 0 ? atoll(size) : MEMO_SIZE;
+        //scanning the whole directory on every store would cost more than the runs
+        if(memo_stored < 0 || memo_stored >= limit / 16){
+            memo_stored = 0;
+            memo_evict(dir, limit);
+        }
+        memo_stored += sizeof(hdr) + hdr.out_len + hdr.err_len;
+    }
+    close(out_fd);
+    close(err_fd);
+    return status;
+}
+
+/* coproc NAME cmd [args...] starts cmd as a background job with both
+   its stdin and stdout connected to the shell, see coproc_vars() for
+   how later commands find them.  coproc -c NAME closes its stdin so it
+   can finish; the job is reaped like any other.  */
+int start_coproc(char *args[]){
+    int to[2], from[2];
+    job *j;
+
+    if(args[0] != NULL && strcmp(args[0], "-c") == 0){
+        for(j = first_job; j; j = j->next){
+            if(j->coproc_name && args[1] && strcmp(j->coproc_name, args[1]) == 0){
+                close_coproc_input(j);
+                return 0;
+            }
+        }
+        fprintf(stderr, "coproc: %s: no such coprocess\n", args[1] ? args[1] : "");
+        return 1;
+    }
+    if(args[0] == NULL || args[1] == NULL){
+        fprintf(stderr, "coproc: usage: coproc NAME command [args...]\n");
+        return 2;
+    }
+    if(pipe2(to, O_CLOEXEC) < 0){
+        perror("pipe");
+        return 1;
+    }
+    if(pipe2(from, O_CLOEXEC) < 0){
+        perror("pipe");
+        close(to[0]);
+        close(to[1]);
+        return 1;
+    }
+
+    job_stdin = to[0];
+    job_stdout = from[1];
+    j = create_job(args[1], args + 2, 1);
+    job_stdin = STDIN_FILENO;
+    job_stdout = STDOUT_FILENO;
+    close(to[0]);
+    close(from[1]);
+    if(j == NULL || job_is_completed(j)){
+        close(to[1]);
+        close(from[0]);
+        return 1;
+    }
+    j->coproc_name = strdup(args[0]);
+    j->coproc_in = to[1];
+    j->coproc_out = from[0];
+    coproc_vars(args[0], j);
+    return 0;
+}
+
+/* read [-u FD] NAME...: read one line into the named variables, split on
+   blanks with the last name taking the rest.  Reads a byte at a time so
+   nothing past the newline is taken from a shared pipe.  */
+int read_line_builtin(char *args[]){
+    int fd = STDIN_FILENO;
+    char line[65536];
+    size_t len = 0;
+    ssize_t n = 0;
+    char c;
+
+    if(args[0] != NULL && strcmp(args[0], "-u") == 0 && args[1] != NULL){
+        fd = atoi(args[1]);
+        args += 2;
+    }
+    while(len < sizeof(line) - 1 && (n = read(fd, &c, 1)) == 1 && c != '\n'){
+        line[len++] = c;
+    }
+    line[len] = '\0';
+
+    char *rest = line;
+    for(int i = 0; args[i] != NULL; i++){
+        while(*rest == ' ' || *rest == '\t')
+            rest++;
+        char *word = rest;
+        if(args[i+1] != NULL){
+            while(*rest && *rest != ' ' && *rest != '\t')
+                rest++;
+            if(*rest)
+                *rest++ = '\0';
+        }
+        set_var(args[i], word, 0);
+    }
+    //nothing read at all means end of input
+    return (n == 1 || len > 0) ? 0 : 1;
+}
+
+//set -o NAME turns an option on, set +o NAME off, set -o lists them
+int set_options(char *args[]){
+    if(args[0] == NULL || args[1] == NULL){
+        for(int i = 0; shell_options[i].name; i++){
+            printf("%-12s %s\n", shell_options[i].name,
+                   *shell_options[i].flag ? "on" : "off");
+        }
+        return 0;
+    }
+    int on = strcmp(args[0], "-o") == 0;
+    if(!on && strcmp(args[0], "+o") != 0){
+        fprintf(stderr, "set: usage: set [-o|+o] option\n");
+        return 1;
+    }
+    for(int i = 0; shell_options[i].name; i++){
+        if(strcmp(shell_options[i].name, args[1]) == 0){
+            *shell_options[i].flag = on;
+            return 0;
+        }
+    }
+    fprintf(stderr, "set: %s: no such option\n", args[1]);
+    return 1;
+}
+
+//NAME=value on a line by itself only sets a shell variable
+void assign_vars(char *command, char *args[]){
+    char *eq = strchr(command, '=');
+    *eq = '\0';
+    set_var(command, eq + 1, 0);
+    *eq = '=';
+    for(int i = 0; args[i] != NULL; i++){
+        eq = strchr(args[i], '=');
+        *eq = '\0';
+        set_var(args[i], eq + 1, 0);
+        *eq = '=';
+    }
+}
+
+int only_assignments(char *command, char *args[]){
+    if(!is_assignment(command))
+        return 0;
+    for(int i = 0; args[i] != NULL; i++){
+        if(!is_assignment(args[i]))
+            return 0;
+    }
+    return 1;
+}
+
+/* Run one parsed command line.  Returns 1 when the shell should exit.  */
+/* Does a ( ) group have to fork to keep its changes to itself?  Only if
+   some line could change the shell: a state builtin, bare assignments, a
+   function (it could do either), or a command word we can't see yet.  */
+int group_forks(function *g){
+    const char *state[] = { "cd", "export", "unset", "set", "hash", "read", "coproc",
+                            "exit", "return", "wait", "fg", "bg", NULL };
+    for(int i = 0; i < g->nlines; i++){
+        char **w = g->lines[i];
+        while(*w && is_assignment(*w))
+            w++;
+        if(*w == NULL || strchr(*w, '$') || find_function(*w))
+            return 1;
+        for(int k = 0; state[k]; k++){
+            if(strcmp(*w, state[k]) == 0)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/* Run the ( ) group g, with tail the words after its ), as a job.  The
+   job runs it in the shell unless group_forks() says otherwise.  g is
+   freed.  */
+void run_group(function *g, char *tail){
+    g->forks = group_forks(g);
+
+    //what follows the ) is redirections and maybe a &
+    process *p = (process *)calloc(1, sizeof(process));
+    char *words[MAX_ARGS + 2];
+    int n = split_words(tail, words, MAX_ARGS + 1);
+    int is_bg = run_in_background;
+    if(n > 0 && strcmp(words[n-1], "&") == 0){
+        is_bg = 1;
+        n--;
+    }
+    p->pidfd = -1;
+    p->group = g;
+    p->argv = (char **)calloc(2, sizeof(char *));
+    p->argv[0] = strdup("(");
+    for(int i = 0; i < n; i++){
+        char *word = expand_word(words[i]);
+        int used = parse_redirect(p, word, i + 1 < n ? words[i+1] : NULL);
+        free(word);
+        if(used <= 0){
+            if(used == 0)
+                fprintf(stderr, "wsh: syntax error near '%s'\n", words[i]);
+            free_processes(p);
+            free_function(g);
+            last_status = 2;
+            return;
+        }
+        i += used - 1;
+    }
+
+    job *j = (job *)malloc(sizeof(job));
+    j->command = strdup(is_bg ? "( ... ) &" : "( ... )");
+    j->first_process = p;
+    add_job(j, is_bg);
+    launch_job(j);
+    //a forked group took its own copy of the body
+    p->group = NULL;
+    p->function = NULL;
+    free_function(g);
+    if(!is_bg && job_is_completed(j)){
+        last_status = job_exit_status(j);
+        set_pipestatus(j);
+        remove_job(j);
     }
-    return curr_path;
 }
 
-void launch_job(job *j){
-    process *p;
-    pid_t pid;
-    int mypipe[2], infile, outfile;
+/* If the line in buffer is a ( ... ) group, read the rest of it and run
+   it.  One line works, ( cmd args ) > file, and so does a ( on its own
+   line up to a line starting with ), which can be followed by
+   redirections or &.  Returns 1 if the line was a group.  */
+int read_group(line_reader *in, int prompt){
+    char *c = buffer;
+    char tail[4096] = "";
 
-    infile = j->stdin;
+    buffer[strcspn(buffer, "\n")] = '\0';
+    while(*c == ' ' || *c == '\t')
+        c++;
+    if(*c != '(')
+        return 0;
 
-    //loop through 
-    for (p = j->first_process; p; p=p->next){
-        //set up pipes if necessary
-        if(p->next){
-            if(pipe (mypipe) <0){
-                perror ("pipe");
-                exit(1);
+    function *g = (function *)calloc(1, sizeof(function));
+    g->name = strdup("(");
+    char *close = strrchr(c, ')');
+    if(close){
+        *close = '\0';
+        snprintf(tail, sizeof(tail), "%s", close + 1);
+        add_function_line(g, c + 1);
+    }
+    else{
+        add_function_line(g, c + 1);
+        while(1){
+            if(prompt){
+                printf("> ");
+                fflush(stdout);
             }
-            outfile = mypipe[1];
+            if(in == NULL || read_line(in) < 0){
+                fprintf(stderr, "wsh: unexpected end of input in ( )\n");
+                free_function(g);
+                return 1;
+            }
+            buffer[strcspn(buffer, "\n")] = '\0';
+            char *line = buffer;
+            while(*line == ' ' || *line == '\t')
+                line++;
+            if(*line == ')'){
+                snprintf(tail, sizeof(tail), "%s", line + 1);
+                break;
+            }
+            add_function_line(g, line);
         }
-        else{
-            outfile = j->stdout;
+    }
+    run_group(g, tail);
+    return 1;
+}
+
+//nothing but blank lines left in a script, so the line just read is its last
+int input_done(line_reader *in){
+    while(1){
+        for(size_t i = in->start; i < in->len; i++){
+            if(in->data[i] != ' ' && in->data[i] != '\t' && in->data[i] != '\n')
+                return 0;
+        }
+        if(in->eof)
+            return 1;
+        //only blanks are buffered, drop them and look further
+        in->start = 0;
+        in->len = 0;
+        if(in->cap == 0){
+            in->cap = 4096;
+            in->data = (char *)malloc(in->cap);
         }
+        ssize_t got = read(in->fd, in->data, in->cap);
+        if(got > 0)
+            in->len = got;
+        else if(got == 0 || errno != EINTR)
+            in->eof = 1;
+    }
+}
 
-        char *curr_path = get_path(p);
-        if(strcmp(curr_path, "0") == 0){
-            //path not found continue or break?
-            break;
+int handle_prompt(char* command, char* args[]){
+    int status = 0;
+    //blank line
+    if(command[0] == '\0'){
+        return 0;
+    }
+    //chack what the command is 
+    if (strcmp(command, "exit") == 0) {
+        //exit N leaves with N, plain exit with the last status
+        if(args[0] != NULL)
+            last_status = atoi(args[0]);
+        return 1;
+    } 
+    else if (strcmp(command, "cd") == 0) {
+        status = change_dir(args[0]);
+        if( status != 0){
+             fprintf(stderr, "cd: Failed to change directory\n");
         }
-        //fork the child processes
-        pid = fork();
-        if(pid == 0){
-            //this is the child process
-            launch_process(p,j->pgid, infile, outfile, j->stderr, j->curr_bg, curr_path);
+    } 
+    else if (strcmp(command, "export") == 0) {
+        status = export_vars(args);
+    }
+    else if (strcmp(command, "hash") == 0) {
+        status = hash_cmds(args);
+    }
+    else if (strcmp(command, "unset") == 0) {
+        //unset -f NAME... forgets functions instead
+        int funcs = args[0] != NULL && strcmp(args[0], "-f") == 0;
+        for(int i = funcs; args[i] != NULL; i++){
+            if(funcs)
+                unset_function(args[i]);
+            else
+                unset_var(args[i]);
         }
-        else if(pid < 0){
-            //the fork failed
-            perror("fork");
-            exit(1);
+    }
+    else if (strcmp(command, "return") == 0) {
+        if(func_depth == 0){
+            fprintf(stderr, "return: can only be used in a function\n");
+            status = 1;
         }
         else{
-            //this is the parent process
-            p->pid = pid;
-            if(shell_is_interactive){
-                if(!j->pgid){
-                    j->pgid = pid;
-                }
-                setpgid(pid, j->pgid);
-            }
+            status = args[0] ? atoi(args[0]) : last_status;
+            func_returning = 1;
         }
-        //clean up after pipes
-        if(infile != j->stdin){
-            close(infile);
+    }
+    else if (only_assignments(command, args)) {
+        assign_vars(command, args);
+    }
+    else if (strcmp(command, "jobs") == 0) {
+        status = list_all_jobs(args);
+    } 
+    else if (strcmp(command, "timeout") == 0) {
+        int at = parse_timeout(args);
+        int done = 0;
+        if(at >= 0 && untimed_builtin(args[at], args + at + 1)){
+            fprintf(stderr, "timeout: %s: runs in the shell, can't be timed out\n", args[at]);
+            at = -1;
         }
-        if(outfile != j->stdout){
-            close(outfile);
+        if(at >= 0)
+            done = handle_prompt(args[at], args + at + 1);
+        //unless a job took it already
+        next_timeout_ns = 0;
+        next_grace_ns = -1;
+        next_timeout_signal = SIGTERM;
+        if(at >= 0)
+            return done;
+        status = 125;
+    }
+    else if (strcmp(command, "ulimit") == 0) {
+        int at;
+        status = ulimit_builtin(args, &at);
+        if(at >= 0){
+            int done = handle_prompt(args[at], args + at + 1);
+            //a builtin took no process to limit
+            free(next_limits);
+            next_limits = NULL;
+            next_nlimits = 0;
+            return done;
         }
-        infile = mypipe[0];
     }
-
-    format_job_info(j, "launched");
-
-    if(!shell_is_interactive){
-        wait_for_job(j);
+    else if (strcmp(command, "cgroup") == 0) {
+        int at;
+        status = cgroup_builtin(args, &at);
+        if(at >= 0){
+            int done = handle_prompt(args[at], args + at + 1);
+            next_cgroup = 0;
+            next_cpu_max[0] = '\0';
+            next_memory_max[0] = '\0';
+            return done;
+        }
     }
-    else if(j->curr_bg){
-        put_job_in_background(j, 0);
+    else if (strcmp(command, "stats") == 0) {
+        status = show_stats(args);
+    }
+    else if (strcmp(command, "forkstat") == 0) {
+        status = fork_stats();
+    }
+    else if (strcmp(command, "output") == 0) {
+        status = show_output(args);
+    }
+    else if (strcmp(command, "coproc") == 0) {
+        status = start_coproc(args);
+    }
+    else if (strcmp(command, "read") == 0) {
+        status = read_line_builtin(args);
+    }
+    else if (strcmp(command, "memo") == 0) {
+        status = memo_run(args);
+    }
+    else if (strcmp(command, "wait") == 0) {
+        status = wait_jobs(args);
+    }
+    else if (strcmp(command, "set") == 0) {
+        status = set_options(args);
+    }
+    else if(strcmp(command, "fg") == 0){
+        // move_process(args, 1);
+    }
+    else if(strcmp(command, "bg") == 0){
+        // move_process(args, 0);
     }
     else{
-        put_job_in_foreground(j, 0);
+        //find if the job is supposed to be in the background or not
+        int is_bg = run_in_background; //one when the command should run in the fg
+        int j = 0;
+        while(args[j] != NULL){
+            j = j+1;
+        }
+        //a trailing & puts it in the background
+        if(j > 0 && strcmp(args[j-1], "&") == 0){
+            is_bg = 1;
+            free(args[j-1]);
+            args[j-1] = NULL;
+        }
+        //create the jobs and processes, this launches it too
+        exec_in_place = last_line && !is_bg;
+        job *new_job = create_job(command, args, is_bg);
+        exec_in_place = 0;
+        if(new_job == NULL){
+            last_status = 2;    //syntax error
+            return 0;
+        }
+        //finished foreground jobs don't need to stay in the table
+        if(!is_bg && job_is_completed(new_job)){
+            perf_report(new_job);
+            notified_job(new_job);
+            status = job_exit_status(new_job);
+            set_pipestatus(new_job);
+            remove_job(new_job);
+        }
     }
+    last_status = status;
+    return 0;
 }
 
-
-//TODO: this needs to parse the 
-void parse_process(char* command, char* args[]){
-    buffer[strcspn(buffer, "\n")] = '\0';
-    char* token = strtok(buffer, " ");
-    int arg_index = 0;
-
-     //get the comand
-    strcpy(command, token);
-
-    // Extract arguments
-    while (token != NULL) {
-        token = strtok(NULL, " ");
-        if (token != NULL) {
-            args[arg_index] = strdup(token);
-            arg_index = arg_index + 1;
-        }
+//free the words parse_process allocated for the last line
+void clear_args(char *args[]){
+    int j =0;
+    while(args[j] != NULL){
+        free(args[j]);
+        args[j] = NULL;
+        j = j+ 1;
     }
-
-    // args[arg_index] = '\0';
 }
 
-process *create_process(char *command, char **args){
-    //handle the first process
-    process *first_process = (process *)malloc(sizeof(process));; //need to FREE
-    process *last_process = NULL; //need to FREE
-    process *current_process = (process *)malloc(sizeof(process)); //need to FREE
-
-    char *proc_args[256]; // need to FREE
-    for (int i = 0; i < 256; i++) {
-        proc_args[i] = NULL;
-    }
-    
-    char *first_proc_args[256]; // need to FREE
-    for (int i = 0; i < 256; i++) {
-        first_proc_args[i] = NULL;
-    }
-
-    proc_args[0]=  command;
-    int arg_count = 0;
-    int curr_count = 1;
-    
-    //TODO: might need to be a zero
-    //create the next process until "|" or null
-    do{
-        while((args[arg_count] != NULL) && (strcmp(args[arg_count], "|") != 0)){
-            if(strcmp(args[arg_count], "&") == 0){
-                break; //dont want the bg command to be included in the last args
-            }
-            strcpy(proc_args[curr_count], args[arg_count]);
-            arg_count = arg_count + 1;
-            curr_count = curr_count + 1;
-        }
-        proc_args[curr_count] = NULL; //null terminator
-        current_process->completed = 0;
-        current_process->stopped = 0;
-        current_process->argv = (char **)malloc(sizeof(char *) * (curr_count + 1)); //TODO might have one extra null term
-        first_process->argv = (char **)malloc(sizeof(char *) * (curr_count + 1));
-        current_process->argv = proc_args;
-        if(first_process == NULL){
-            memcpy(first_process, current_process, sizeof(process));
-            for(int j = 0; j<curr_count; j++){
-                strcpy(first_proc_args[j], proc_args[j]);
+void read_in_prompt(char* command, char *args[]){
+    line_reader in = { STDIN_FILENO, NULL, 0, 0, 0, 0 };
+    while(1){
+            //tell the user about jobs that finished or stopped
+            do_job_notification();
+            //print the prompt to the user
+            printf("wsh> ");
+            fflush(stdout);
+            if(read_line(&in) < 0){
+                break;  //end of input
+            }
+            if(read_function(&in, 1) || read_group(&in, 1)){
+                continue;
+            }
+            parse_process(command, args);
+            int done = handle_prompt(command, args);
+            clear_args(args);
+            if(done){
+                break;
             }
-            first_process->argv = first_proc_args;
-            last_process = current_process;
         }
-        else{
-            last_process->next = current_process;
-            last_process = current_process;
-        }
-        // if((args[arg_count] == NULL) ){
-        //     break; //reached the end of the args
-        // }
-        // else{
-        //     //clear the local array
-        //     for(int i = 0; i<curr_count; i++){
-        //         proc_args[i] = NULL;
-        //     }
-        //     curr_count = 0;
-        //     arg_count  = arg_count + 1;
-        // }
-        //clear the local array
-        for(int i = 0; i<curr_count; i++){
-            proc_args[i] = NULL;
-        }
-        curr_count = 0;
-    } while(args[arg_count] != NULL);
+}
 
+//utility functions for daemon mode
 
-    return first_process;
+//add up the usage of every process in a job
+void job_usage(job *j, struct rusage *total){
+    process *p;
+    memset(total, 0, sizeof(*total));
+    for(p = j->first_process; p; p = p->next){
+        timeradd(&total->ru_utime, &p->usage.ru_utime, &total->ru_utime);
+        timeradd(&total->ru_stime, &p->usage.ru_stime, &total->ru_stime);
+        if(p->usage.ru_maxrss > total->ru_maxrss)
+            total->ru_maxrss = p->usage.ru_maxrss;
+        total->ru_minflt += p->usage.ru_minflt;
+        total->ru_majflt += p->usage.ru_majflt;
+        total->ru_inblock += p->usage.ru_inblock;
+        total->ru_oublock += p->usage.ru_oublock;
+        total->ru_nvcsw += p->usage.ru_nvcsw;
+        total->ru_nivcsw += p->usage.ru_nivcsw;
+    }
+}
 
+//send the result back and forget the client
+void finish_client(client *c, int status, job *j){
+    daemon_reply reply;
+    client **link;
+
+    //a client that hung up already has fd -1
+    if(c->fd >= 0){
+        memset(&reply, 0, sizeof(reply));
+        reply.status = status;
+        if(j)
+            job_usage(j, &reply.usage);
+        send(c->fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+        remove_watch(c->fd);
+        close(c->fd);
+    }
 
-    //allocate memory for argv and use command and 
+    for(link = &first_client; *link; link = &(*link)->next){
+        if(*link == c){
+            *link = c->next;
+            break;
+        }
+    }
+    for(int i = 0; i < 3; i++){
+        if(c->fds[i] >= 0)
+            close(c->fds[i]);
+    }
+    free(c);
 }
 
-job *create_job(char *command, char ** args, int is_bg){
-    job *j = (job *)malloc(sizeof(job));
-    job *comp_job = NULL;
-    j->next = NULL;
-    j->command = strdup(command);
-    //parse the args in the create process func
-    j->first_process = create_process(command, args);
-    j->pgid = 0;
-    j->curr_bg = is_bg;
-    int need_id = 1;
-    int curr_id = 0;
+/* A client sent its command line, along with up to three fds for the
+   job's stdin, stdout and stderr.  Builtins run right away with their
+   output sent to the client, anything else becomes a background job
+   whose result is sent back once it completes.  */
+void serve_client(int fd, void *data){
+    client *c = (client *)data;
+    char text[65536];
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { text, sizeof(text) - 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    char command[256];
+    char *args[MAX_ARGS];
 
-    //find the smallest id availible
-    if(first_job == NULL){
-        j->id = 1;
-    }
-    else{
-        while(need_id){
-            curr_id = curr_id + 1;
-            need_id = 0;    //assume that this run will find correct id
-            for (comp_job = first_job; comp_job; comp_job=comp_job->next){
-                if(comp_job->id == curr_id){
-                    need_id = 1; //found a match
-                }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    //only a client's first message carries a command and its fds
+    int take = n > 0 && c->job == NULL;
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for(int i = 0; i < count; i++){
+                int passed;
+                memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if(take && i < 3)
+                    c->fds[i] = passed;
+                else
+                    close(passed);
             }
         }
-        j->id = curr_id;
     }
+    if(n <= 0 && c->job == NULL){
+        finish_client(c, 1, NULL);
+        return;
+    }
+    if(n <= 0){
+        //hung up while its job runs: stop watching, the job finishes
+        //on its own and its result goes nowhere
+        remove_watch(fd);
+        close(fd);
+        c->fd = -1;
+        return;
+    }
+    if(!take){
+        //talking while its job runs
+        return;
+    }
+    text[n] = '\0';
 
-    //initialize stdin, stdout, stderr
-    j->stdin = STDIN_FILENO;
-    j->stdout = STDOUT_FILENO;
-    j->stderr = STDERR_FILENO;
+    //don't let the job read the daemon's own stdin
+    if(c->fds[0] < 0)
+        c->fds[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
-    launch_job(j);
-    return j;
-}
+    if(strlen(text) + 1 > bufsize){
+        bufsize = strlen(text) + 1;
+        buffer = (char *)realloc(buffer, bufsize);
+    }
+    strcpy(buffer, text);
+    parse_process(command, args);
 
-//where did the foreground and 
-// void launch_process(process *p, pid_t pgid, int infile, int outfile, int errfile, int foreground){
+    //builtins write straight to the client's stdout and stderr
+    int saved_out = dup(STDOUT_FILENO);
+    int saved_err = dup(STDERR_FILENO);
+    if(c->fds[1] >= 0)
+        dup2(c->fds[1], STDOUT_FILENO);
+    if(c->fds[2] >= 0)
+        dup2(c->fds[2], STDERR_FILENO);
 
-// }
+    job *before = current_job;
+    job_stdin = c->fds[0];
+    job_stdout = STDOUT_FILENO;
+    job_stderr = STDERR_FILENO;
+    run_in_background = 1;
+    handle_prompt(command, args);
+    run_in_background = 0;
+    job_stdin = STDIN_FILENO;
 
-int change_dir(char *arg){
-    //TODO ARGS MIGHT NEED TO BE SHIFTED OVER ONE
-    //make sure  to have at least one parameter
-    if (arg == 0) { 
-        fprintf(stderr, "cd: Needs one more argument\n");
-        return 1; // Error
+    fflush(stdout);
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_out);
+    close(saved_err);
+    clear_args(args);
+
+    if(current_job != before && current_job != NULL){
+        c->job = current_job;
     }
-    // Use chdir to change the current directory returns 0 on success
-    if (chdir(arg) != 0) {
-        fprintf(stderr, "cd: Unable to change to directory requested\n");
-        return 1; // Error
+    else{
+        finish_client(c, last_status, NULL);
     }
-    return 0; // Success
 }
 
-// int move_process(char* args[], int curr_fg){
-//     //check the correct amount of parameters are passed to it
-//     if(args[1] != NULL){
-//         fprintf(stderr, "move_process: Passed in too many parameters\n");
-//         return 1; //Error
-//     }
-//     //if no arg is passed through need tp use largest id
-//     if(args[0] == NULL){
-//         int largest_id = -1;
-//         for (int i = 0; i < 256; i++) {
-//             if (jobs[i].id > largest_id) {
-//                 largest_id = jobs[i].id;
-//             }
-//         }
-//         for(int i = 0; i < 256; i++){
-//             if(jobs[i].id == largest_id){
-//                 if(curr_fg){
-//                     tcsetpgrp(STDIN_FILENO, jobs[i].pid); //bring to the foreground
-//                 }
-//                 else{
-//                     kill(jobs[i].pid, SIGCONT);
-//                 }
-//                 return 0; //Success   
-//             }
-//         }
-//         //if finsishes loop = error did not find pid to bring to fg
-//     }
-//     //if arg is passed use that one
-//     else{
-//         //get the id from the arg
-//         int target_id = atoi(args[0]);
-//         for(int i = 0; i<256; i++){
-//             if(jobs[i].id == target_id){
-//                 if(curr_fg){
-//                     tcsetpgrp(STDIN_FILENO, jobs[i].pid); //bring to the foreground
-//                 }
-//                 else{
-//                     kill(jobs[i].pid, SIGCONT);
-//                 }
-//                 return 0; //Success found target id
-//             }
-//         }
-//         //might need an error statement here in case don't find id
-//     }
-//     return 1; //Should not reach this if found process 
-// }
-
-// void list_all_jobs(char* command, char* args[]){
-//     int size_of_args;
-//     int index = 0;
-//     printf("Background jobs:\n");
-//     for (int i=0; i<256; i++){
-//         if(jobs.id[i] != -1){
-//             while(args[index] != NULL){
-//                 index++;
-//             }
-//             //TODO: not sure if i can do this compare
-//             if(strcmp(args[index-1], "&") == 0){
-//                 //TODO: print the corret output with program and args then [&]
-//             }
-//             else{
-//                 //TODO: print same thing without ampersand
-//             }
-//             index = 0;      //reset it for the next job to find num of args
-//         }
-//     }
-// }
+//a new connection on the daemon socket
+void accept_client(int fd, void *data){
+    int conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if(conn < 0)
+        return;
+    client *c = (client *)calloc(1, sizeof(client));
+    c->fd = conn;
+    c->fds[0] = c->fds[1] = c->fds[2] = -1;
+    c->next = first_client;
+    first_client = c;
+    add_watch(conn, serve_client, c);
+}
 
+/* wsh -d SOCKET: keep one warm shell and run the command lines clients
+   submit on a Unix socket, replying with exit status and rusage.  */
+void run_daemon(const char *socket_path){
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
 
-void read_in_prompt(char* command, char *args[]){
-    for(int i=0; i<3; i++){
-            //print the prompt to the user
-            printf("wsh> ");
-            getline(&buffer,&bufsize,stdin);
-            parse_process(command, args);
-            printf("curr command: %s, i=%d\n", command, i);
-            
-            
-            //chack what the command is 
-            if (strcmp(command, "exit") == 0) {
-                break;
-            } 
-            else if (strcmp(command, "cd") == 0) {
-                printf("want to cd\n");
-                int result = change_dir(args[0]);
-                if( result != 0){
-                     fprintf(stderr, "cd: Failed to change directory\n");
-                }
-            } 
-            else if (strcmp(command, "jobs") == 0) {
-                // Implement the 'jobs' command to list background jobs
-                // complete after fg, bg and pipes are complete
-            } 
-            else if(strcmp(command, "fg") == 0){
-                // move_process(args, 1);
-            }
-            else if(strcmp(command, "bg") == 0){
-                // move_process(args, 0);
-            }
-            else if(strcmp(command, "jobs") == 0){
-                //list_all_jobs(command, args); //need the command to pring and args to tell if bg init
-            }
-            else{
-                //find if the job is supposed to be in the background or not
-                int is_bg = 0; //one when the command should run in the fg
-                //int j = 0;
-                // while(args[j] != NULL){
-                //     j = j+1;
-                // }
-                // //if true needs to be in the bg
-                // if(strcmp(args[j-1], "&") == 0){
-                //     is_bg = 1;
-                // } TODO gives segmentation fault
-                //create the jobs and processes
-                if(first_job == NULL){
-                    current_job = create_job(command, args, is_bg);
-                    first_job = current_job;
-                }
-                else{
-                    job *new_job = create_job(command, args, is_bg);
-                    current_job->next = new_job;
-                    current_job = new_job;
-                }
-                //launch the current job here
-                
-            }
+    if(fd < 0){
+        perror("socket");
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    unlink(socket_path);
+    //only our user gets to submit commands
+    mode_t old_mask = umask(077);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0){
+        perror(socket_path);
+        exit(1);
+    }
+    umask(old_mask);
+    add_watch(fd, accept_client, NULL);
 
-            int j =0;
-            while(args[j] != NULL){
-                printf("argNum: %d, arg: %s\n", j, args[j]);
-                args[j] = NULL;
-                j = j+ 1;
+    while(1){
+        run_events(-1, -1);
+        client *c, *next;
+        for(c = first_client; c; c = next){
+            next = c->next;
+            if(c->job && job_is_completed(c->job)){
+                job *j = c->job;
+                finish_client(c, job_exit_status(j), j);
+                remove_job(j);
             }
-            //read in the prompt from the user and determine what to do 
         }
+    }
 }
-void handle_prompt(char* command, char* args[]){
-    /////////////ADDCODE: does not work rn
-    // Execute external commands
-    //execute_command(command, args); TODO //need to check if bg job
-    int child_pid;
-    child_pid = fork();
-    if(child_pid < 0){ //fork failed
-        perror("fork");
-        exit(0);
+
+/* wsh -s SOCKET cmdline: hand cmdline and our stdin/stdout/stderr to a
+   daemon and exit with the status it sends back.  */
+int submit_command(const char *socket_path, const char *line){
+    struct sockaddr_un addr;
+    int std_fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    char control[CMSG_SPACE(sizeof(std_fds))];
+    struct iovec iov = { (void *)line, strlen(line) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    daemon_reply reply;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    if(fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        perror(socket_path);
+        return 1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(std_fds));
+    memcpy(CMSG_DATA(cmsg), std_fds, sizeof(std_fds));
+    if(sendmsg(fd, &msg, 0) < 0){
+        perror("sendmsg");
+        return 1;
     }
-    else if(child_pid == 0){
-        // if (execvp(*command, args) == -1) {
-        // perror("execvp");
-        // exit(1);
-        //}
+    if(recv(fd, &reply, sizeof(reply), 0) != sizeof(reply)){
+        fprintf(stderr, "wsh: daemon hung up\n");
+        return 1;
     }
-    else if(child_pid > 0){
-        //don't need to do anythin
-        //wait pid allows the parent to wait for the child pid to finish and then resumes
+    close(fd);
+    if(get_var("WSH_RUSAGE") != NULL){
+        fprintf(stderr, "status %d user %ld.%06lds sys %ld.%06lds maxrss %ldkB\n",
+                reply.status,
+                (long)reply.usage.ru_utime.tv_sec, (long)reply.usage.ru_utime.tv_usec,
+                (long)reply.usage.ru_stime.tv_sec, (long)reply.usage.ru_stime.tv_usec,
+                reply.usage.ru_maxrss);
     }
-//if command name equal to special call method to handle
-    //else create a child process using fork and then 
-    //execvp will run the child process 
+    return reply.status;
 }
 
-
 int main(int argc, char *argv[]){
     char *command;
     command = malloc(256* sizeof(*command));
-    char *args[256];
+    char *args[MAX_ARGS];
 
     // Initialize the args array
-    for (int i = 0; i < 256; i++) {
+    for (int i = 0; i < MAX_ARGS; i++) {
         args[i] = NULL;
     }
 
     //setup for the buffer 
     setup();
 
+    //start with the variables we inherited
+    import_environ();
+    status_on = getenv("WSH_STATUS") != NULL;
+    cgroup_on = getenv("WSH_CGROUP") != NULL;
+
+    //client mode never runs anything itself
+    if(argc == 4 && strcmp(argv[1], "-s") == 0){
+        return submit_command(argv[2], argv[3]);
+    }
+    //the daemon and -c one-liners have no terminal to manage
+    if(argc == 3 && (strcmp(argv[1], "-d") == 0 || strcmp(argv[1], "-c") == 0)){
+        want_terminal = 0;
+    }
+
     //setup shell
     init_shell();
 
+    if(argc == 3 && strcmp(argv[1], "-d") == 0){
+        run_daemon(argv[2]);
+    }
+
+    //wsh -c 'cmdline' runs the one line and exits with its status
+    if(argc == 3 && strcmp(argv[1], "-c") == 0){
+        if(strlen(argv[2]) + 1 > bufsize){
+            bufsize = strlen(argv[2]) + 1;
+            buffer = (char *)realloc(buffer, bufsize);
+        }
+        strcpy(buffer, argv[2]);
+        //nothing runs after the line, so its command can take over the process
+        last_line = 1;
+        if(!read_group(NULL, 0)){
+            parse_process(command, args);
+            handle_prompt(command, args);
+        }
+        save_disk_cache();
+        return last_status;
+    }
+
     //if the arg amount is two go to batch mode and run from that
     //skip the while loop
     if(argc == 1){
@@ -788,16 +7740,34 @@ int main(int argc, char *argv[]){
     else if(argc == 2){
         char* filename = argv[1]; 
         //do some checking to make sure that file is accurate
-        FILE *file_in = fopen(filename, "r");
+        line_reader in = { open(filename, O_RDONLY | O_CLOEXEC), NULL, 0, 0, 0, 0 };
+        if(in.fd < 0){
+            perror(filename);
+            exit(1);
+        }
 
-        while(fgets(buffer,bufsize,file_in)){
-            //ADD CODE handle that line
+        while(read_line(&in) >= 0){
+            do_job_notification();
+            if(read_function(&in, 0)){
+                continue;
+            }
+            last_line = input_done(&in);
+            if(read_group(&in, 0)){
+                continue;
+            }
             parse_process(command, args);
-            handle_prompt(command, args);
+            int done = handle_prompt(command, args);
+            clear_args(args);
+            if(done){
+                break;
+            }
         }
+        close(in.fd);
+        free(in.data);
     }
 
-    return 0;
+    save_disk_cache();
+    return last_status;
 
     //while loop for however many commands in the script
 }
@@ -0,0 +1,206 @@
+//wshjournal.c
+//turn a wsh job journal (WSH_JOURNAL) into CSV, one row per job
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+/* The record layout, it has to match the one in wsh.c.  A journal is
+   the magic and then records, each starting with a journal_head whose
+   size covers the whole record.  Several sessions may follow each other
+   in one file, jobs are told apart by shell pid and job number.  */
+#define JOURNAL_MAGIC "WSHJRNL1"
+
+#define JOURNAL_TEXT 1
+#define JOURNAL_START 2
+#define JOURNAL_END 3
+
+typedef struct journal_head{
+    uint8_t type;
+    uint8_t flags;
+    uint16_t size;
+    uint32_t job;
+} journal_head;
+
+typedef struct journal_text{
+    journal_head head;
+    uint64_t hash;
+} journal_text;
+
+typedef struct journal_start{
+    journal_head head;
+    uint64_t hash;
+    uint64_t text;
+    int64_t time_ns;
+    int32_t pgid;
+    int32_t shell_pid;
+} journal_start;
+
+typedef struct journal_end{
+    journal_head head;
+    int32_t status;
+    int32_t processes;
+    int64_t duration_ns;
+    int64_t utime_us;
+    int64_t stime_us;
+    int64_t maxrss_kb;
+} journal_end;
+
+//command texts by file offset
+typedef struct text_entry{
+    struct text_entry *next;
+    uint64_t offset;
+    char *text;
+} text_entry;
+
+//jobs started and not ended yet, by job number
+typedef struct open_job{
+    struct open_job *next;
+    journal_start start;
+    const char *text;
+} open_job;
+
+#define TABLE_SIZE 65536
+text_entry *texts[TABLE_SIZE];
+open_job *jobs[TABLE_SIZE];
+int last_pid = 0;               //the session whose jobs are in the table
+
+const char *find_text(uint64_t offset){
+    for(text_entry *t = texts[offset % TABLE_SIZE]; t; t = t->next){
+        if(t->offset == offset)
+            return t->text;
+    }
+    return "";
+}
+
+void put_csv_string(const char *s){
+    putchar('"');
+    for(; *s; s++){
+        if(*s == '"')
+            putchar('"');
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+//one row, end is NULL for a job the journal never saw finish
+void print_job(open_job *j, journal_end *end){
+    printf("%d,%u,%d,%lld.%09lld,%016llx,", j->start.shell_pid, j->start.head.job,
+           j->start.pgid, (long long)(j->start.time_ns / 1000000000),
+           (long long)(j->start.time_ns % 1000000000), (unsigned long long)j->start.hash);
+    if(end)
+        printf("%d,%d,%.6f,%.6f,%.6f,%lld,", end->status, end->processes,
+               end->duration_ns / 1e9, end->utime_us / 1e6, end->stime_us / 1e6,
+               (long long)end->maxrss_kb);
+    else
+        printf(",,,,,,");
+    put_csv_string(j->text);
+    putchar('\n');
+}
+
+//a new session reuses job numbers, report what the last one left open
+void flush_jobs(void){
+    for(int i = 0; i < TABLE_SIZE; i++){
+        while(jobs[i]){
+            open_job *next = jobs[i]->next;
+            print_job(jobs[i], NULL);
+            free(jobs[i]);
+            jobs[i] = next;
+        }
+    }
+}
+
+int decode(FILE *in, const char *name){
+    char magic[8];
+    union {
+        journal_head head;
+        journal_text text;
+        journal_start start;
+        journal_end end;
+        char bytes[65536];
+    } r;
+    uint64_t offset = sizeof(magic);
+
+    if(fread(magic, 1, sizeof(magic), in) != sizeof(magic) || memcmp(magic, JOURNAL_MAGIC, 8) != 0){
+        fprintf(stderr, "%s: not a wsh journal\n", name);
+        return 1;
+    }
+    while(fread(&r.head, sizeof(r.head), 1, in) == 1){
+        if(r.head.size < sizeof(r.head)){
+            fprintf(stderr, "%s: bad record at %llu\n", name, (unsigned long long)offset);
+            return 1;
+        }
+        size_t rest = r.head.size - sizeof(r.head);
+        if(fread(r.bytes + sizeof(r.head), 1, rest, in) != rest){
+            fprintf(stderr, "%s: cut short at %llu\n", name, (unsigned long long)offset);
+            break;
+        }
+        if(r.head.type == JOURNAL_TEXT && r.head.size >= sizeof(journal_text)){
+            size_t len = r.head.size - sizeof(journal_text);
+            text_entry *t = (text_entry *)malloc(sizeof(text_entry));
+            t->offset = offset;
+            t->text = (char *)malloc(len + 1);
+            memcpy(t->text, r.bytes + sizeof(journal_text), len);
+            t->text[len] = '\0';
+            t->next = texts[offset % TABLE_SIZE];
+            texts[offset % TABLE_SIZE] = t;
+        }
+        else if(r.head.type == JOURNAL_START && r.head.size == sizeof(journal_start)){
+            if(r.start.shell_pid != last_pid){
+                flush_jobs();
+                last_pid = r.start.shell_pid;
+            }
+            open_job *j = (open_job *)malloc(sizeof(open_job));
+            j->start = r.start;
+            j->text = find_text(r.start.text);
+            j->next = jobs[r.head.job % TABLE_SIZE];
+            jobs[r.head.job % TABLE_SIZE] = j;
+        }
+        else if(r.head.type == JOURNAL_END && r.head.size == sizeof(journal_end)){
+            for(open_job **link = &jobs[r.head.job % TABLE_SIZE]; *link; link = &(*link)->next){
+                if((*link)->start.head.job == r.head.job){
+                    open_job *j = *link;
+                    print_job(j, &r.end);
+                    *link = j->next;
+                    free(j);
+                    break;
+                }
+            }
+        }
+        offset += r.head.size;
+    }
+    flush_jobs();
+    return 0;
+}
+
+//wshjournal [FILE...]: CSV of the jobs in each journal, or stdin
+int main(int argc, char *argv[]){
+    int status = 0;
+
+    printf("shell_pid,job,pgid,start,argv_hash,status,processes,duration_s,user_s,sys_s,maxrss_kb,command\n");
+    if(argc == 1)
+        return decode(stdin, "stdin");
+    for(int i = 1; i < argc; i++){
+        FILE *in = fopen(argv[i], "rb");
+        if(in == NULL){
+            perror(argv[i]);
+            status = 1;
+            continue;
+        }
+        //offsets are per file, so are the texts
+        for(int b = 0; b < TABLE_SIZE; b++){
+            while(texts[b]){
+                text_entry *next = texts[b]->next;
+                free(texts[b]->text);
+                free(texts[b]);
+                texts[b] = next;
+            }
+        }
+        last_pid = 0;
+        status |= decode(in, argv[i]);
+        fclose(in);
+    }
+    return status;
+}
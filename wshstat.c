@@ -0,0 +1,185 @@
+//wshstat.c
+//print the job tables wsh publishes with set -o status (or WSH_STATUS set)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* The page layout, it has to match the one in wsh.c.  Records are read
+   lock free: a copy only counts if the record's seq was even and the same
+   before and after it was taken, else wsh was writing and we go again.  */
+#define STATUS_MAGIC 0x57534853     //"WSHS"
+#define STATUS_VERSION 1
+#define STATUS_COMMAND 96
+
+#define STATUS_FREE 0
+#define STATUS_RUNNING 1
+#define STATUS_STOPPED 2
+#define STATUS_DONE 3
+
+typedef struct status_record{
+    uint32_t seq;
+    int32_t id;
+    int32_t pgid;
+    int32_t state;
+    int32_t processes;
+    int32_t exit_status;
+    int64_t start_ns;
+    int64_t utime_us;
+    int64_t stime_us;
+    int64_t maxrss_kb;
+    char command[STATUS_COMMAND];
+} status_record;
+
+typedef struct status_page{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t record_size;
+    int32_t shell_pid;
+    uint32_t dropped;
+    status_record records[];
+} status_page;
+
+//a consistent copy of record r
+void read_record(status_record *r, status_record *out){
+    uint32_t before, after;
+    do{
+        before = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+        if(before & 1)
+            continue;
+        memcpy(out, r, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&r->seq, __ATOMIC_RELAXED);
+    }while((before & 1) || before != after);
+}
+
+const char *state_name(int state, int exit_status, char *buf, size_t len){
+    switch(state){
+    case STATUS_RUNNING:
+        return "Running";
+    case STATUS_STOPPED:
+        return "Stopped";
+    case STATUS_DONE:
+        snprintf(buf, len, "Done(%d)", exit_status);
+        return buf;
+    }
+    return "?";
+}
+
+//print the jobs of the shell with pid, 0 if it has a page
+int show_shell(int pid){
+    char name[64];
+    struct stat st;
+    struct timespec now;
+
+    snprintf(name, sizeof(name), "/dev/shm/wsh-%d", pid);
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        perror(name);
+        return 1;
+    }
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(status_page)){
+        fprintf(stderr, "%s: not a wsh status page\n", name);
+        close(fd);
+        return 1;
+    }
+    status_page *page = (status_page *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(page == MAP_FAILED){
+        perror(name);
+        return 1;
+    }
+    if(__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != STATUS_MAGIC
+       || page->version != STATUS_VERSION || page->record_size != sizeof(status_record)
+       || sizeof(status_page) + (size_t)page->slots * page->record_size > (size_t)st.st_size){
+        fprintf(stderr, "%s: not a wsh status page\n", name);
+        munmap(page, st.st_size);
+        return 1;
+    }
+
+    //a shell killed outright leaves its page behind
+    int gone = kill(pid, 0) < 0 && errno == ESRCH;
+    printf("wsh %d%s%s\n", pid, gone ? " (gone)" : "",
+           page->dropped ? " (some jobs not shown, table full)" : "");
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t now_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    for(uint32_t i = 0; i < page->slots; i++){
+        status_record r;
+        char state[32];
+        read_record(&page->records[i], &r);
+        if(r.id == 0)
+            continue;
+        r.command[STATUS_COMMAND - 1] = '\0';
+        printf("  [%d] %-10s pgid %-7d %2d proc %8.2fs  user %.2fs sys %.2fs rss %lld KiB  %s\n",
+               r.id, state_name(r.state, r.exit_status, state, sizeof(state)), r.pgid,
+               r.processes, (now_ns - r.start_ns) / 1e9, r.utime_us / 1e6, r.stime_us / 1e6,
+               (long long)r.maxrss_kb, r.command);
+    }
+    munmap(page, st.st_size);
+    return 0;
+}
+
+//every shell that has a page
+int show_all(void){
+    DIR *dir = opendir("/dev/shm");
+    struct dirent *e;
+    int found = 0;
+
+    if(dir == NULL){
+        perror("/dev/shm");
+        return 1;
+    }
+    while((e = readdir(dir)) != NULL){
+        if(strncmp(e->d_name, "wsh-", 4) == 0 && atoi(e->d_name + 4) > 0){
+            show_shell(atoi(e->d_name + 4));
+            found = 1;
+        }
+    }
+    closedir(dir);
+    if(!found)
+        printf("no wsh is publishing its jobs\n");
+    return 0;
+}
+
+//wshstat [-w SECONDS] [PID...]
+int main(int argc, char *argv[]){
+    double every = 0;
+    int first = 1;
+    int status = 0;
+
+    if(argc > 2 && strcmp(argv[1], "-w") == 0){
+        every = atof(argv[2]);
+        first = 3;
+    }
+    if(argc > 1 && argv[1][0] == '-' && first == 1){
+        fprintf(stderr, "usage: wshstat [-w SECONDS] [PID...]\n");
+        return 2;
+    }
+    for(;;){
+        if(first == argc){
+            status = show_all();
+        }
+        else{
+            status = 0;
+            for(int i = first; i < argc; i++)
+                status |= show_shell(atoi(argv[i]));
+        }
+        if(every <= 0)
+            break;
+        fflush(stdout);
+        struct timespec pause = { (time_t)every, (long)((every - (time_t)every) * 1e9) };
+        nanosleep(&pause, NULL);
+        printf("\n");
+    }
+    return status;
+}